@@ -9,6 +9,8 @@
  * SPD5118 compliant temperature sensors are typically used on memory modules.
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
 #include <linux/bitops.h>
 #include <linux/bitfield.h>
 #include <linux/module.h>
@@ -19,7 +21,30 @@
 #include <linux/hwmon.h>
 #include <linux/err.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/wait.h>
+#include <linux/miscdevice.h>
+#include <linux/platform_device.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/crc-itu-t.h>
+#include <linux/list.h>
 #include <linux/of.h>
+#include <linux/pm.h>
+#include <linux/pm_runtime.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
+
+#include "spd5118.h"
 
 /* Addresses to scan */
 static const unsigned short normal_i2c[] = {
@@ -30,13 +55,49 @@ static const unsigned short normal_i2c[] = {
 #define SPD5118_REG_REVISION		(0x02) /* MR2 */
 #define SPD5118_REG_VENDOR		(0x03) /* MR3:MR4 */
 #define SPD5118_REG_I2C_LEGACY_MODE	(0x0B) /* MR11 */
+#define SPD5118_REG_WRITE_PROTECT	(0x0C) /* MR12:MR13 */
 #define SPD5118_REG_TEMP_CLR		(0x13) /* MR19 */
+#define SPD5118_REG_TEMP_CONFIG		(0x1a) /* MR26 */
 #define SPD5118_REG_TEMP_MAX		(0x1c) /* MR28:MR29 */
 #define SPD5118_REG_TEMP_MIN		(0x1e) /* MR30:MR31 */
 #define SPD5118_REG_TEMP_CRIT		(0x20) /* MR32:MR33 */
 #define SPD5118_REG_TEMP_LCRIT		(0x22) /* MR34:MR35 */
 #define SPD5118_REG_TEMP		(0x31) /* MR49:MR50 */
 #define SPD5118_REG_TEMP_STATUS		(0x33) /* MR51 */
+#define SPD5118_REG_DEV_STATUS		(0x30) /* MR48 */
+
+#define SPD5118_TS_DISABLE		(1 << 0)
+
+/*
+ * RDIMMs may carry TS5111 thermal sensors next to the hub, answering at
+ * 0x10 (TS0) and 0x30 (TS1) with the hub's HID in the low bits. They share
+ * the hub's thermal register layout and show up as temp2 and temp3.
+ */
+#define SPD5118_HID_MASK		0x07
+#define SPD5118_TS_TYPE			0x5111	/* MR0:MR1 of a TS5111 */
+#define SPD5118_NUM_CHANNELS		3	/* hub, TS0, TS1 */
+
+/* DDR5 PMIC (JESD301), at 0x48 with the hub's HID */
+#define SPD5118_PMIC_LID		0x48
+#define SPD5118_PMIC_REG_CURRENT	0x0c	/* R0C:R0F, SWA..SWD */
+#define SPD5118_PMIC_REG_METER		0x1a
+#define SPD5118_PMIC_METER_POWER	BIT(1)	/* R0C:R0F report power instead */
+#define SPD5118_PMIC_REG_ADC_CTRL	0x30
+#define SPD5118_PMIC_ADC_ENABLE		BIT(7)
+#define SPD5118_PMIC_ADC_SELECT		GENMASK(6, 3)
+#define SPD5118_PMIC_REG_ADC_READ	0x31
+#define SPD5118_PMIC_REG_VENDOR		0x3c	/* R3C:R3D */
+#define SPD5118_PMIC_CURRENT_MASK	GENMASK(5, 0)	/* 7:6 reserved */
+#define SPD5118_PMIC_CURRENT_LSB_MA	125
+#define SPD5118_PMIC_VOLTAGE_LSB_MV	15
+#define SPD5118_PMIC_RAILS		4
+
+/* Time for the first valid conversion after the sensor is enabled, in us */
+#define SPD5118_TEMP_CONV_US		10000
+
+/* Re-probe backoff bounds for hubs that stopped responding */
+#define SPD5118_REPROBE_MIN_MS		1000
+#define SPD5118_REPROBE_MAX_MS		60000
 
 #define SPD5118_TEMP_STATUS_HIGH	(1 << 0)
 #define SPD5118_TEMP_STATUS_LOW		(1 << 1)
@@ -48,12 +109,44 @@ static const unsigned short normal_i2c[] = {
 #define SPD5118_TEMP_CLR_CRIT		(1 << 2)
 #define SPD5118_TEMP_CLR_LCRIT		(1 << 3)
 
+/* MR28:MR35 hold the four limits as consecutive little endian words */
+#define SPD5118_NUM_LIMITS		4
+#define SPD5118_LIMIT_INDEX(reg)	(((reg) - SPD5118_REG_TEMP_MAX) / 2)
+
 #define SPD5118_NUM_PAGES		8
 #define SPD5118_PAGE_SIZE		128
 #define SPD5118_PAGE_SHIFT		7
 #define SPD5118_EEPROM_BASE		0x80
 #define SPD5118_EEPROM_SIZE		(SPD5118_PAGE_SIZE * SPD5118_NUM_PAGES)
 
+/* NVM writes: MR12:MR13 protect 64 byte blocks, writes go 16 bytes at once */
+#define SPD5118_WP_BLOCK_SHIFT		6
+#define SPD5118_WRITE_SIZE		16
+#define SPD5118_WRITE_TIMEOUT_US	20000
+#define SPD5118_WRITE_POLL_US		500
+#define SPD5118_STATUS_WRITE_BUSY	(1 << 3)	/* MR48 */
+
+/* DDR5 SPD contents, JESD400-5 */
+#define SPD_DDR5_DEVICE_TYPE		2
+#define SPD_DDR5_MODULE_TYPE		3
+#define SPD_DDR5_DENSITY		4
+#define SPD_DDR5_IO_WIDTH		6
+#define SPD_DDR5_TCK_MIN		20	/* 20:21 */
+#define SPD_DDR5_CRC			510	/* 510:511, over 0:509 */
+#define SPD_DDR5_ORGANIZATION		234
+#define SPD_DDR5_BUS_WIDTH		235
+#define SPD_DDR5_MFG_ID			512	/* 512:513 */
+#define SPD_DDR5_KEY			SPD_DDR5_CRC	/* 510:520, see spd5118_key_hash() */
+#define SPD_DDR5_KEY_LEN		11
+#define SPD_DDR5_MFG_YEAR		515
+#define SPD_DDR5_MFG_WEEK		516
+#define SPD_DDR5_SERIAL			517	/* 517:520 */
+#define SPD_DDR5_PART_NUMBER		521	/* 521:550 */
+#define SPD_DDR5_PART_NUMBER_LEN	30
+#define SPD_DDR5_DRAM_MFG_ID		552	/* 552:553 */
+
+#define SPD_DDR5_TYPE_SDRAM		0x12
+
 /* Temperature unit in millicelsius */
 #define SPD5118_TEMP_UNIT (1000 / 4)
 /* Representable temperature range in millicelsius */
@@ -65,19 +158,252 @@ static bool enable_temp_write;
 module_param(enable_temp_write, bool, false);
 MODULE_PARM_DESC(enable_temp_write, "Enable setting temperature thresholds");
 
+static bool enable_eeprom_write;
+module_param(enable_eeprom_write, bool, false);
+MODULE_PARM_DESC(enable_eeprom_write, "Enable writing the SPD EEPROM");
+
 static bool enable_alarm_write;
 module_param(enable_alarm_write, bool, false);
 MODULE_PARM_DESC(enable_alarm_write, "Enable resetting temperature alarms");
 
+#define SPD5118_MAX_HINTS		16
+
+static char *probe_addrs[SPD5118_MAX_HINTS];
+static int num_probe_addrs;
+module_param_array(probe_addrs, charp, &num_probe_addrs, 0444);
+MODULE_PARM_DESC(probe_addrs, "Known hubs to instantiate without probing, as bus:address pairs or client names like 0-0050");
+
+static int ts_autosuspend_ms = -1;
+module_param(ts_autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(ts_autosuspend_ms, "Disable the thermal sensor after this many ms without readers (-1 = never)");
+
+static unsigned int xfer_retries = 2;
+module_param(xfer_retries, uint, 0644);
+MODULE_PARM_DESC(xfer_retries, "Retries for transient SMBus errors");
+
+static unsigned int xfer_backoff_us = 500;
+module_param(xfer_backoff_us, uint, 0644);
+MODULE_PARM_DESC(xfer_backoff_us, "Delay before the first retry in us, doubled on every further retry");
+
+static unsigned int offline_threshold = 5;
+module_param(offline_threshold, uint, 0644);
+MODULE_PARM_DESC(offline_threshold, "Consecutive failed transfers before a hub is marked offline (0 = never)");
+
+static unsigned int bus_tps;
+module_param(bus_tps, uint, 0644);
+MODULE_PARM_DESC(bus_tps, "SMBus transactions per second allowed for all hubs on one adapter (0 = unlimited)");
+
+static unsigned int bus_burst = 8;
+module_param(bus_burst, uint, 0644);
+MODULE_PARM_DESC(bus_burst, "SMBus transactions allowed back to back before bus_tps applies");
+
+static unsigned int cache_ms;
+module_param(cache_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ms, "Serve temperature and alarms from a sample younger than this many ms");
+
+static unsigned int sample_interval_ms;
+module_param(sample_interval_ms, uint, 0444);
+MODULE_PARM_DESC(sample_interval_ms, "Sample all hubs in the background every this many ms (0 = off)");
+
+static bool scan = true;
+module_param(scan, bool, 0444);
+MODULE_PARM_DESC(scan, "Scan HWMON class adapters for hubs in the background");
+
+static unsigned int window_mc;
+module_param(window_mc, uint, 0444);
+MODULE_PARM_DESC(window_mc, "Let the background sampler poll only the alarm status, with the hub's high/low limits at +/- this many millicelsius around the last reading; 0 disables");
+
+static bool alarm_latch;
+module_param(alarm_latch, bool, false);
+MODULE_PARM_DESC(alarm_latch, "Keep reporting alarms seen by the driver until cleared by writing 0");
+
+static bool pmic_telemetry;
+module_param(pmic_telemetry, bool, false);
+MODULE_PARM_DESC(pmic_telemetry, "Report the module PMIC's rail voltages, currents and power");
+
+
+/*
+ * SMBus budget shared by all hubs on one adapter, as a token bucket kept in
+ * nanoseconds of credit: a transaction costs NSEC_PER_SEC / bus_tps and the
+ * bucket holds bus_burst of them.
+ */
+struct spd5118_bus {
+	struct list_head node;		/* on spd5118_buses */
+	struct i2c_adapter *adapter;
+	unsigned int users;
+	spinlock_t lock;		/* protect credit and last */
+	u64 credit;
+	u64 last;
+	atomic_t transactions;
+	atomic_t throttled;
+	atomic64_t throttled_ns;
+	struct dentry *debugfs;
+};
+
+/*
+ * Bus access classes. Thermal transfers are latency critical (fan control),
+ * bulk transfers are EEPROM and diagnostic reads that can wait; a bulk
+ * transfer never starts while a thermal one of the same hub is pending.
+ */
+enum spd5118_class {
+	SPD5118_CLASS_THERMAL,
+	SPD5118_CLASS_BULK,
+	SPD5118_NUM_CLASSES
+};
+
+static const char * const spd5118_class_names[SPD5118_NUM_CLASSES] = {
+	[SPD5118_CLASS_THERMAL] = "thermal",
+	[SPD5118_CLASS_BULK] = "bulk",
+};
+
+/* Time from asking for a transfer until owning the bus */
+struct spd5118_class_stats {
+	atomic_t transfers;
+	atomic64_t wait_ns;
+	atomic64_t max_wait_ns;
+};
+
+/*
+ * Latest view of the thermal registers of every sensor on the module,
+ * published by spd5118_refill(). Indexed by hwmon channel.
+ */
+struct spd5118_sample {
+	u16 temp[SPD5118_NUM_CHANNELS];		/* MR49:MR50 */
+	u8 status[SPD5118_NUM_CHANNELS];	/* MR51 */
+	u8 latched[SPD5118_NUM_CHANNELS];	/* MR51 bits seen, see alarm_latch */
+	bool stale;				/* last refill failed, temp is older */
+	u16 limits[SPD5118_NUM_CHANNELS][SPD5118_NUM_LIMITS]; /* MR28:MR35 */
+	u8 pmic_curr[SPD5118_PMIC_RAILS];	/* PMIC R0C:R0F */
+	u8 pmic_volt[SPD5118_PMIC_RAILS];	/* PMIC R31, per rail */
+	u8 pmic_volt_valid;			/* rails converted so far */
+	ktime_t timestamp;			/* last successful read, 0 if none */
+};
+
+/* MR51 transition seen by the sampler, kept in spd5118_data.events */
+struct spd5118_event {
+	ktime_t time;
+	u16 temp;			/* MR49:MR50 that came with it */
+	u8 channel;
+	u8 old_status;
+	u8 new_status;
+};
+
+#define SPD5118_NUM_EVENTS		64	/* power of two */
+
+/* Fields decoded from the EEPROM shadow, see spd5118_spd_get() */
+struct spd5118_spd {
+	u16 manufacturer;		/* JEP106, same layout as MR3:MR4 */
+	u16 dram_manufacturer;
+	u8 module_type;
+	u8 year;			/* BCD */
+	u8 week;			/* BCD */
+	u32 serial;
+	char part_number[SPD_DDR5_PART_NUMBER_LEN + 1];
+	unsigned int ranks;
+	unsigned int capacity_mb;
+	unsigned int tck_ps;
+	unsigned int speed;		/* MT/s */
+};
 
-/* Each client has this additional data */
+/*
+ * Each client has this additional data
+ *
+ * Only the EEPROM window depends on the page selected in MR11, so only it
+ * needs page_lock. The thermal registers are not paged and single SMBus
+ * transfers are already serialized by the adapter lock, so thermal reads
+ * from several CPUs go straight to the bus.
+ *
+ * The hwmon callbacks read the sample under sample_seq without taking any
+ * lock; only producers refilling it from the bus take sample_lock.
+ */
 struct spd5118_data {
-	struct mutex update_lock;	/* protect register access */
+	struct i2c_client *client;
+	struct i2c_client *channel[SPD5118_NUM_CHANNELS]; /* NULL if absent */
+	struct i2c_client *pmic;	/* NULL without pmic_telemetry */
+	unsigned int pmic_rail;		/* rail the ADC converts, under sample_lock */
+	struct spd5118_bus *bus;
+	struct list_head node;		/* on spd5118_devices */
+	struct mutex page_lock;		/* protect MR11 and the EEPROM window */
+	struct mutex limits_lock;	/* serialize limit writes */
+	struct mutex sample_lock;	/* serialize sample producers */
+	seqcount_mutex_t sample_seq;
+	struct spd5118_sample sample;
+	struct spd5118_event events[SPD5118_NUM_EVENTS]; /* under sample_lock */
+	unsigned int num_events;	/* ever recorded, wraps */
+	spinlock_t flight_lock;		/* protect the in-flight refill state */
+	bool in_flight;
+	int flight_ret;
+	struct completion flight_done;
 	int current_page;
+	u8 eeprom[SPD5118_EEPROM_SIZE];	/* shadow, under page_lock */
+	unsigned long eeprom_valid;	/* pages of eeprom[] read so far */
+	struct spd5118_spd spd;		/* decoded shadow, if spd_valid */
+	bool spd_valid;
+	u16 crc_stored;			/* SPD CRC, if crc_checked */
+	u16 crc_computed;
+	bool crc_checked;
+	u32 eeprom_generation;		/* bumped whenever the contents change */
+	u32 eeprom_hash;		/* if hash_valid */
+	bool hash_valid;
+	struct work_struct revalidate_work;
 	u16 vendor;
 	u8 revision;
+	bool limits_dirty;		/* limits were programmed by us */
+	bool window_active;		/* MR28:MR31 hold the window, see window_mc */
+	u16 window[SPD5118_NUM_CHANNELS][2]; /* MR28:MR31 in window mode */
+	atomic_t window_quiet;		/* status only rounds */
+	atomic_t window_trips;		/* rounds that re-centred the window */
+	atomic64_t window_bytes;	/* bytes transferred in window mode */
+	atomic64_t window_baseline;	/* bytes full reads would have taken */
+	ktime_t ts_ready;		/* first valid conversion after enable */
+	unsigned long flags;
+	atomic_t failures;		/* consecutive failed transfers */
+	struct delayed_work reprobe_work;
+	unsigned int reprobe_ms;
+	struct dentry *debugfs;
+	atomic_t xfer_transient;
+	atomic_t xfer_fatal;
+	atomic_t xfer_retried;
+	atomic_t stale_reads;
+	atomic_t coalesced;
+	atomic_t thermal_pending;	/* thermal transfers queued or running */
+	wait_queue_head_t bulk_wq;	/* bulk transfers waiting for them */
+	struct spd5118_class_stats class_stats[SPD5118_NUM_CLASSES];
+};
+
+/* Bits in spd5118_data.flags */
+#define SPD5118_OFFLINE			0	/* hub stopped responding */
+
+static struct dentry *spd5118_debugfs;
+
+enum spd5118_mcgrp {
+	SPD5118_MCGRP_SAMPLES,
+	SPD5118_MCGRP_ALARMS,
+};
+
+static const struct genl_multicast_group spd5118_mcgrps[] = {
+	[SPD5118_MCGRP_SAMPLES] = { .name = SPD5118_GENL_MCGRP_SAMPLES },
+	[SPD5118_MCGRP_ALARMS] = { .name = SPD5118_GENL_MCGRP_ALARMS },
+};
+
+static struct genl_family spd5118_genl_family = {
+	.name		= SPD5118_GENL_NAME,
+	.version	= SPD5118_GENL_VERSION,
+	.maxattr	= SPD5118_A_MAX,
+	.module		= THIS_MODULE,
+	.mcgrps		= spd5118_mcgrps,
+	.n_mcgrps	= ARRAY_SIZE(spd5118_mcgrps),
 };
 
+static bool spd5118_genl_registered;
+
+static struct spd5118_ring *spd5118_ring;
+static DEFINE_SPINLOCK(spd5118_ring_lock);	/* serialize ring producers */
+
+static LIST_HEAD(spd5118_devices);
+static LIST_HEAD(spd5118_buses);
+static DEFINE_MUTEX(spd5118_devices_lock);	/* protect both lists */
+
 static bool spd5118_vendor_valid(u16 reg)
 {
 	u8 pfx = reg & 0xff;
@@ -103,380 +429,2470 @@ static u16 spd5118_temp_to_reg(int temp)
 	return ((temp / SPD5118_TEMP_UNIT) & 0x7ff) << 2;
 }
 
-static int spd5118_read_temp(struct i2c_client *client, u32 attr, long *val)
+static int spd5118_bus_stats_show(struct seq_file *s, void *unused)
 {
-	struct spd5118_data *data = i2c_get_clientdata(client);
-	int reg, regval;
-
-	switch (attr) {
-	case hwmon_temp_input:
-		reg = SPD5118_REG_TEMP;
-		break;
-	case hwmon_temp_max:
-		reg = SPD5118_REG_TEMP_MAX;
-		break;
-	case hwmon_temp_min:
-		reg = SPD5118_REG_TEMP_MIN;
-		break;
-	case hwmon_temp_crit:
-		reg = SPD5118_REG_TEMP_CRIT;
-		break;
-	case hwmon_temp_lcrit:
-		reg = SPD5118_REG_TEMP_LCRIT;
-		break;
-	default:
-		return -EOPNOTSUPP;
-	}
+	struct spd5118_bus *bus = s->private;
+
+	seq_printf(s, "tps: %u\n", READ_ONCE(bus_tps));
+	seq_printf(s, "burst: %u\n", READ_ONCE(bus_burst));
+	seq_printf(s, "transactions: %d\n", atomic_read(&bus->transactions));
+	seq_printf(s, "throttled: %d\n", atomic_read(&bus->throttled));
+	seq_printf(s, "throttled_us: %lld\n",
+		   div_s64(atomic64_read(&bus->throttled_ns), NSEC_PER_USEC));
+	return 0;
+}
 
-	mutex_lock(&data->update_lock);
-	regval = i2c_smbus_read_word_data(client, reg);
-	mutex_unlock(&data->update_lock);
-	if (regval < 0)
-		return regval;
+DEFINE_SHOW_ATTRIBUTE(spd5118_bus_stats);
 
-	*val = spd5118_temp_from_reg(regval);
+static int spd5118_sched_stats_show(struct seq_file *s, void *unused)
+{
+	struct spd5118_data *data = s->private;
+	struct spd5118_class_stats *stats;
+	int cls, transfers;
+
+	seq_puts(s, "class transfers avg_wait_us max_wait_us\n");
+	for (cls = 0; cls < SPD5118_NUM_CLASSES; cls++) {
+		stats = &data->class_stats[cls];
+		transfers = atomic_read(&stats->transfers);
+		seq_printf(s, "%s %d %lld %lld\n", spd5118_class_names[cls], transfers,
+			   transfers ? div_s64(div_s64(atomic64_read(&stats->wait_ns),
+						       transfers), NSEC_PER_USEC) : 0,
+			   div_s64(atomic64_read(&stats->max_wait_ns), NSEC_PER_USEC));
+	}
 	return 0;
 }
 
-static int spd5118_write_temp(struct i2c_client *client, u32 attr, long val)
+DEFINE_SHOW_ATTRIBUTE(spd5118_sched_stats);
+
+static struct spd5118_bus *spd5118_bus_get(struct i2c_adapter *adapter)
 {
-	struct spd5118_data *data = i2c_get_clientdata(client);
-	int reg, ret;
-	u16 regval;
+	struct spd5118_bus *bus;
 
-	if (WARN_ON(!enable_temp_write))
-		return -EOPNOTSUPP;
+	mutex_lock(&spd5118_devices_lock);
 
-	switch (attr) {
-	case hwmon_temp_max:
-		reg = SPD5118_REG_TEMP_MAX;
-		break;
-	case hwmon_temp_min:
-		reg = SPD5118_REG_TEMP_MIN;
-		break;
-	case hwmon_temp_crit:
-		reg = SPD5118_REG_TEMP_CRIT;
-		break;
-	case hwmon_temp_lcrit:
-		reg = SPD5118_REG_TEMP_LCRIT;
-		break;
-	default:
-		return -EOPNOTSUPP;
+	list_for_each_entry(bus, &spd5118_buses, node) {
+		if (bus->adapter == adapter) {
+			bus->users++;
+			goto out;
+		}
 	}
 
-	regval = spd5118_temp_to_reg(val);
-	mutex_lock(&data->update_lock);
-	ret = i2c_smbus_write_word_data(client, reg, regval);
-	mutex_unlock(&data->update_lock);
-	return ret;
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus)
+		goto out;
+
+	bus->adapter = adapter;
+	bus->users = 1;
+	spin_lock_init(&bus->lock);
+	bus->debugfs = debugfs_create_dir(dev_name(&adapter->dev), spd5118_debugfs);
+	debugfs_create_file("bus", 0444, bus->debugfs, bus, &spd5118_bus_stats_fops);
+	list_add_tail(&bus->node, &spd5118_buses);
+out:
+	mutex_unlock(&spd5118_devices_lock);
+	return bus;
 }
 
-static int spd5118_read_alarm(struct i2c_client *client, u32 attr, long *val)
+static void spd5118_bus_put(struct spd5118_bus *bus)
 {
-	struct spd5118_data *data = i2c_get_clientdata(client);
-	int mask, regval;
-
-	switch (attr) {
-	case hwmon_temp_max_alarm:
-		mask = SPD5118_TEMP_STATUS_HIGH;
-		break;
-	case hwmon_temp_min_alarm:
-		mask = SPD5118_TEMP_STATUS_LOW;
-		break;
-	case hwmon_temp_crit_alarm:
-		mask = SPD5118_TEMP_STATUS_CRIT;
-		break;
-	case hwmon_temp_lcrit_alarm:
-		mask = SPD5118_TEMP_STATUS_LCRIT;
-		break;
-	default:
-		return -EOPNOTSUPP;
+	mutex_lock(&spd5118_devices_lock);
+	if (!--bus->users) {
+		list_del(&bus->node);
+		debugfs_remove_recursive(bus->debugfs);
+		kfree(bus);
 	}
-
-	mutex_lock(&data->update_lock);
-	regval = i2c_smbus_read_byte_data(client, SPD5118_REG_TEMP_STATUS);
-	mutex_unlock(&data->update_lock);
-	if (regval < 0)
-		return regval;
-	*val = !!(regval & mask);
-	return 0;
+	mutex_unlock(&spd5118_devices_lock);
 }
 
-static int spd5118_clear_alarm(struct i2c_client *client, u32 attr)
+/* Take a token from the bucket, or return how many ns until one is there */
+static u64 spd5118_bus_take(struct spd5118_bus *bus, unsigned int tps)
 {
-	struct spd5118_data *data = i2c_get_clientdata(client);
-	int ret;
-	u8 regval;
-
-	if (WARN_ON(!enable_alarm_write))
-		return -EOPNOTSUPP;
+	u64 cost = div_u64(NSEC_PER_SEC, tps);
+	u64 now = ktime_get_ns();
+	u64 wait = 0;
+
+	spin_lock(&bus->lock);
+	bus->credit = min(bus->credit + (now - bus->last),
+			  cost * max(READ_ONCE(bus_burst), 1U));
+	bus->last = now;
+	if (bus->credit >= cost)
+		bus->credit -= cost;
+	else
+		wait = cost - bus->credit;
+	spin_unlock(&bus->lock);
+
+	return wait;
+}
 
-	switch (attr) {
-	case hwmon_temp_max_alarm:
-		regval = SPD5118_TEMP_CLR_HIGH;
-		break;
-	case hwmon_temp_min_alarm:
-		regval = SPD5118_TEMP_CLR_LOW;
-		break;
-	case hwmon_temp_crit_alarm:
-		regval = SPD5118_TEMP_CLR_CRIT;
-		break;
-	case hwmon_temp_lcrit_alarm:
-		regval = SPD5118_TEMP_CLR_LCRIT;
-		break;
-	default:
-		return -EOPNOTSUPP;
+static void spd5118_bus_throttle(struct spd5118_bus *bus)
+{
+	unsigned int tps;
+	bool throttled = false;
+	u64 wait;
+
+	atomic_inc(&bus->transactions);
+
+	for (;;) {
+		tps = READ_ONCE(bus_tps);
+		if (!tps)
+			break;
+
+		wait = spd5118_bus_take(bus, tps);
+		if (!wait)
+			break;
+
+		if (!throttled) {
+			atomic_inc(&bus->throttled);
+			throttled = true;
+		}
+		atomic64_add(wait, &bus->throttled_ns);
+		fsleep(div_u64(wait, NSEC_PER_USEC) + 1);
 	}
-
-	mutex_lock(&data->update_lock);
-	ret = i2c_smbus_write_byte_data(client, SPD5118_REG_TEMP_CLR, regval);
-	mutex_unlock(&data->update_lock);
-	return ret;
 }
 
-static int spd5118_read(struct device *dev, enum hwmon_sensor_types type,
-		     u32 attr, int channel, long *val)
+/* Errors worth retrying, see Documentation/i2c/fault-codes.rst */
+static bool spd5118_xfer_transient(int err)
 {
-	struct i2c_client *client = dev_get_drvdata(dev);
-
-	if (type != hwmon_temp)
-		return -EOPNOTSUPP;
-
-	switch (attr) {
-	case hwmon_temp_input:
-	case hwmon_temp_max:
-	case hwmon_temp_min:
-	case hwmon_temp_crit:
-	case hwmon_temp_lcrit:
-		return spd5118_read_temp(client, attr, val);
-	case hwmon_temp_max_alarm:
-	case hwmon_temp_min_alarm:
-	case hwmon_temp_crit_alarm:
-	case hwmon_temp_lcrit_alarm:
-		return spd5118_read_alarm(client, attr, val);
+	switch (err) {
+	case -EAGAIN:		/* arbitration lost */
+	case -ENXIO:		/* no ACK */
+	case -EREMOTEIO:
+	case -ETIMEDOUT:
+	case -EIO:
+	case -EPROTO:
+	case -EBADMSG:		/* PEC mismatch */
+		return true;
 	default:
-		return -EOPNOTSUPP;
+		return false;
 	}
 }
 
-static int spd5118_write(struct device *dev, enum hwmon_sensor_types type,
-		      u32 attr, int channel, long val)
+/*
+ * Once a hub keeps failing, stop sending it transfers that can each burn
+ * the adapter's timeout. Reads fail fast until spd5118_reprobe_work_fn()
+ * sees the hub again.
+ */
+static void spd5118_xfer_failed(struct spd5118_data *data)
 {
-	struct i2c_client *client = dev_get_drvdata(dev);
+	if (!offline_threshold ||
+	    atomic_inc_return(&data->failures) < offline_threshold)
+		return;
 
-	if (type != hwmon_temp)
-		return -EOPNOTSUPP;
+	if (test_and_set_bit(SPD5118_OFFLINE, &data->flags))
+		return;
 
-	switch (attr) {
-	case hwmon_temp_max:
-	case hwmon_temp_min:
-	case hwmon_temp_crit:
-	case hwmon_temp_lcrit:
-		return spd5118_write_temp(client, attr, val);
-	case hwmon_temp_max_alarm:
-	case hwmon_temp_min_alarm:
-	case hwmon_temp_crit_alarm:
-	case hwmon_temp_lcrit_alarm:
-		if (val)
-			return -EINVAL;
-		return spd5118_clear_alarm(client, attr);
-	default:
-		return -EOPNOTSUPP;
-	}
+	dev_warn(&data->client->dev, "Hub stopped responding, marking offline\n");
+	data->reprobe_ms = SPD5118_REPROBE_MIN_MS;
+	queue_delayed_work(system_freezable_wq, &data->reprobe_work,
+			   msecs_to_jiffies(data->reprobe_ms));
 }
 
-static umode_t spd5118_is_visible(const void *_data, enum hwmon_sensor_types type,
-			       u32 attr, int channel)
+static void spd5118_account_wait(struct spd5118_class_stats *stats, s64 wait)
 {
-	if (type != hwmon_temp)
-		return 0;
+	s64 max = atomic64_read(&stats->max_wait_ns);
 
-	switch (attr) {
-	case hwmon_temp_input:
-		return 0444;
-	case hwmon_temp_min:
-	case hwmon_temp_max:
-	case hwmon_temp_crit:
-	case hwmon_temp_lcrit:
-		return enable_temp_write ? 0644 : 0444;
-	case hwmon_temp_min_alarm:
-	case hwmon_temp_max_alarm:
-	case hwmon_temp_crit_alarm:
-	case hwmon_temp_lcrit_alarm:
-		return enable_alarm_write ? 0644 : 0444;
-	default:
-		return 0;
-	}
+	atomic_inc(&stats->transfers);
+	atomic64_add(wait, &stats->wait_ns);
+	while (wait > max && !atomic64_try_cmpxchg(&stats->max_wait_ns, &max, wait))
+		;
 }
 
-static ssize_t
-revision_show(struct device *dev, struct device_attribute *attr, char *buf)
+/*
+ * Take the bus for one transfer. Bulk transfers step aside for as long as
+ * thermal ones are pending, so a large EEPROM read only ever delays a
+ * temperature read by the one chunk already on the wire.
+ */
+static void spd5118_lock_bus(struct spd5118_data *data, enum spd5118_class cls)
 {
-	struct spd5118_data *data = dev_get_drvdata(dev);
-	/* From JESD300-5B
-	 *   MR2 bits [5:4]: Major revision, 1..4
-	 *   MR2 bits [3:1]: Minor revision, 0..8? Probably a typo.
-	 */
-	return sprintf(buf, "%d.%d\n", 1 + ((data->revision >> 4) & 3), (data->revision >> 1) & 7);
-}
-
-static DEVICE_ATTR_RO(revision);
+	struct i2c_adapter *adapter = data->client->adapter;
 
-static ssize_t
-pmic_vendor_id_show(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	struct spd5118_data *data = dev_get_drvdata(dev);
-	u8 pfx = data->vendor & 0x7f;
-	u8 id = (data->vendor >> 8) & 0x7f;
-	int n = 0;
+	for (;;) {
+		if (cls == SPD5118_CLASS_BULK)
+			wait_event(data->bulk_wq, !atomic_read(&data->thermal_pending));
 
-	while (pfx--) {
-		n += 3;
-		*buf++ = '7';
-		*buf++ = 'F';
-		*buf++ = ' ';
+		i2c_lock_bus(adapter, I2C_LOCK_SEGMENT);
+		if (cls != SPD5118_CLASS_BULK || !atomic_read(&data->thermal_pending))
+			return;
+		i2c_unlock_bus(adapter, I2C_LOCK_SEGMENT);
 	}
-	/* Low byte is number of 7F prefixes of the JEP106 ID */
-	return n + sprintf(buf, "%02X\n", id);
 }
 
-static DEVICE_ATTR_RO(pmic_vendor_id);
-
-static struct attribute *spd5118_attrs[] = {
-	&dev_attr_revision.attr,
-	&dev_attr_pmic_vendor_id.attr,
-	NULL,
-};
-
-static int spd5118_set_current_page(struct i2c_client *client, int page)
+static int spd5118_xfer(struct i2c_client *client, enum spd5118_class cls,
+			char read_write, u8 command, int size,
+			union i2c_smbus_data *smbus)
 {
-	struct device *dev = &client->dev;
-	struct spd5118_data *data = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	unsigned int backoff = xfer_backoff_us;
+	unsigned int attempt;
+	u8 len = size == I2C_SMBUS_I2C_BLOCK_DATA ? smbus->block[0] : 0;
+	/* The PMIC is optional, so it must not take the hub offline either way */
+	bool pmic = (client->addr & ~SPD5118_HID_MASK) == SPD5118_PMIC_LID;
+	u64 queued;
 	int ret;
 
-	if (page == data->current_page)
-		return 0;
+	if (test_bit(SPD5118_OFFLINE, &data->flags))
+		return -ENODEV;
 
-	ret = i2c_smbus_write_byte_data(client, SPD5118_REG_I2C_LEGACY_MODE, page);
-	if (ret < 0) {
-		dev_err(dev, "Failed to select page %d (%d)\n", page, ret);
-		return ret;
+	if (cls == SPD5118_CLASS_THERMAL)
+		atomic_inc(&data->thermal_pending);
+
+	for (attempt = 0; ; attempt++) {
+		queued = ktime_get_ns();
+		spd5118_bus_throttle(data->bus);
+		spd5118_lock_bus(data, cls);
+		spd5118_account_wait(&data->class_stats[cls], ktime_get_ns() - queued);
+		/* What i2c_smbus_xfer() would refuse, before the adapter resumed */
+		if (test_bit(I2C_ALF_IS_SUSPENDED, &client->adapter->locked_flags))
+			ret = -ESHUTDOWN;
+		else
+			ret = __i2c_smbus_xfer(client->adapter, client->addr,
+					       client->flags, read_write, command,
+					       size, smbus);
+		i2c_unlock_bus(client->adapter, I2C_LOCK_SEGMENT);
+		if (ret >= 0) {
+			if (!pmic)
+				atomic_set(&data->failures, 0);
+			break;
+		}
+
+		if (!spd5118_xfer_transient(ret)) {
+			atomic_inc(&data->xfer_fatal);
+			break;
+		}
+
+		atomic_inc(&data->xfer_transient);
+		if (attempt >= xfer_retries) {
+			if (!pmic)
+				spd5118_xfer_failed(data);
+			break;
+		}
+
+		atomic_inc(&data->xfer_retried);
+		fsleep(backoff);
+		backoff *= 2;
+
+		/* Block transfers carry their length in the buffer */
+		if (size == I2C_SMBUS_I2C_BLOCK_DATA)
+			smbus->block[0] = len;
 	}
 
-	dev_dbg(dev, "Selected page %d\n", page);
-	data->current_page = page;
+	if (cls == SPD5118_CLASS_THERMAL &&
+	    atomic_dec_and_test(&data->thermal_pending))
+		wake_up_all(&data->bulk_wq);
 
-	return 0;
+	return ret;
 }
 
-static ssize_t spd5118_eeprom_read(struct i2c_client *client, char *buf,
-				  unsigned int offset, size_t count)
+static int spd5118_read_byte(struct i2c_client *client, u8 reg)
 {
-	int status, page;
+	union i2c_smbus_data smbus;
+	int ret;
+
+	ret = spd5118_xfer(client, SPD5118_CLASS_THERMAL, I2C_SMBUS_READ, reg,
+			   I2C_SMBUS_BYTE_DATA, &smbus);
+	return ret < 0 ? ret : smbus.byte;
+}
+
+static int spd5118_read_word(struct i2c_client *client, u8 reg)
+{
+	union i2c_smbus_data smbus;
+	int ret;
+
+	ret = spd5118_xfer(client, SPD5118_CLASS_THERMAL, I2C_SMBUS_READ, reg,
+			   I2C_SMBUS_WORD_DATA, &smbus);
+	return ret < 0 ? ret : smbus.word;
+}
+
+static int spd5118_write_byte(struct i2c_client *client, u8 reg, u8 val)
+{
+	union i2c_smbus_data smbus = { .byte = val };
+
+	return spd5118_xfer(client, SPD5118_CLASS_THERMAL, I2C_SMBUS_WRITE, reg,
+			    I2C_SMBUS_BYTE_DATA, &smbus);
+}
+
+static int spd5118_write_word(struct i2c_client *client, u8 reg, u16 val)
+{
+	union i2c_smbus_data smbus = { .word = val };
+
+	return spd5118_xfer(client, SPD5118_CLASS_THERMAL, I2C_SMBUS_WRITE, reg,
+			    I2C_SMBUS_WORD_DATA, &smbus);
+}
+
+static int spd5118_write_block(struct i2c_client *client, enum spd5118_class cls,
+			       u8 reg, u8 len, const u8 *buf)
+{
+	union i2c_smbus_data smbus;
+
+	len = min_t(u8, len, I2C_SMBUS_BLOCK_MAX);
+	smbus.block[0] = len;
+	memcpy(&smbus.block[1], buf, len);
+	return spd5118_xfer(client, cls, I2C_SMBUS_WRITE, reg,
+			    I2C_SMBUS_I2C_BLOCK_DATA, &smbus);
+}
+
+/* Like i2c_smbus_read_i2c_block_data_or_emulated(), with our retry policy */
+static int spd5118_read_block(struct i2c_client *client, enum spd5118_class cls,
+			      u8 reg, u8 len, u8 *buf)
+{
+	union i2c_smbus_data smbus;
+	int ret, i = 0;
+
+	len = min_t(u8, len, I2C_SMBUS_BLOCK_MAX);
+
+	if (i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+		smbus.block[0] = len;
+		ret = spd5118_xfer(client, cls, I2C_SMBUS_READ, reg,
+				   I2C_SMBUS_I2C_BLOCK_DATA, &smbus);
+		if (ret < 0)
+			return ret;
+		memcpy(buf, &smbus.block[1], smbus.block[0]);
+		return smbus.block[0];
+	}
+
+	while (i < len) {
+		if (len - i >= 2 &&
+		    i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_READ_WORD_DATA)) {
+			ret = spd5118_xfer(client, cls, I2C_SMBUS_READ, reg + i,
+					   I2C_SMBUS_WORD_DATA, &smbus);
+			if (ret < 0)
+				return ret;
+			buf[i++] = smbus.word & 0xff;
+			buf[i++] = smbus.word >> 8;
+		} else {
+			ret = spd5118_xfer(client, cls, I2C_SMBUS_READ, reg + i,
+					   I2C_SMBUS_BYTE_DATA, &smbus);
+			if (ret < 0)
+				return ret;
+			buf[i++] = smbus.byte;
+		}
+	}
+
+	return i;
+}
+
+static int spd5118_ts_get(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	s64 delay;
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&client->dev);
+	if (ret < 0)
+		return ret;
+
+	/* Don't hand out the stale value from before the sensor was disabled */
+	delay = ktime_us_delta(data->ts_ready, ktime_get());
+	if (delay > 0)
+		fsleep(delay);
+
+	return 0;
+}
+
+static void spd5118_ts_put(struct i2c_client *client)
+{
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_put_autosuspend(&client->dev);
+}
+
+static void spd5118_get_sample(struct spd5118_data *data,
+			       struct spd5118_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&data->sample_seq);
+		*sample = data->sample;
+	} while (read_seqcount_retry(&data->sample_seq, seq));
+}
+
+/*
+ * Append one sensor of a sample to the ring mapped by userspace, see
+ * spd5118.h. Each sensor is reported under its own address.
+ */
+static void spd5118_ring_push(struct spd5118_data *data,
+			      const struct spd5118_sample *sample, int channel)
+{
+	struct i2c_client *client = data->channel[channel];
+	struct spd5118_ring_entry *e;
+	u32 head;
+
+	if (!spd5118_ring)
+		return;
+
+	spin_lock(&spd5118_ring_lock);
+
+	head = spd5118_ring->hdr.head;
+	e = &spd5118_ring->entry[head & (SPD5118_RING_ENTRIES - 1)];
+
+	WRITE_ONCE(e->seq, e->seq + 1);
+	smp_wmb();
+	e->pos = head;
+	e->adapter = i2c_adapter_id(client->adapter);
+	e->addr = client->addr;
+	e->status = sample->status[channel];
+	e->temp = spd5118_temp_from_reg(sample->temp[channel]);
+	e->flags = sample->stale ? SPD5118_SAMPLE_STALE : 0;
+	e->timestamp_ns = ktime_to_ns(sample->timestamp);
+	smp_wmb();
+	WRITE_ONCE(e->seq, e->seq + 1);
+
+	smp_store_release(&spd5118_ring->hdr.head, head + 1);
+
+	spin_unlock(&spd5118_ring_lock);
+}
+
+static bool spd5118_genl_listening(enum spd5118_mcgrp group)
+{
+	return spd5118_genl_registered &&
+	       genl_has_listeners(&spd5118_genl_family, &init_net, group);
+}
+
+static int spd5118_genl_put_sample(struct sk_buff *skb, struct spd5118_data *data,
+				   const struct spd5118_sample *sample, int channel)
+{
+	struct i2c_client *client = data->channel[channel];
+
+	if (nla_put_u32(skb, SPD5118_A_ADAPTER, i2c_adapter_id(client->adapter)) ||
+	    nla_put_u8(skb, SPD5118_A_ADDR, client->addr) ||
+	    nla_put_s32(skb, SPD5118_A_TEMP,
+			spd5118_temp_from_reg(sample->temp[channel])) ||
+	    nla_put_u8(skb, SPD5118_A_STATUS, sample->status[channel]) ||
+	    nla_put_u64_64bit(skb, SPD5118_A_TIMESTAMP,
+			      ktime_to_ns(sample->timestamp), SPD5118_A_PAD) ||
+	    (sample->stale && nla_put_flag(skb, SPD5118_A_STALE)))
+		return -EMSGSIZE;
+	return 0;
+}
+
+static void spd5118_genl_alarm(struct spd5118_data *data, int channel,
+			       u8 old_status, const struct spd5118_sample *sample)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!spd5118_genl_listening(SPD5118_MCGRP_ALARMS))
+		return;
+
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &spd5118_genl_family, 0, SPD5118_CMD_ALARM);
+	if (!hdr ||
+	    nla_put_u8(skb, SPD5118_A_OLD_STATUS, old_status) ||
+	    spd5118_genl_put_sample(skb, data, sample, channel)) {
+		nlmsg_free(skb);
+		return;
+	}
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&spd5118_genl_family, skb, 0, SPD5118_MCGRP_ALARMS,
+			  GFP_KERNEL);
+}
+
+/*
+ * PMIC part of a round: all rail currents in one block read, plus one rail
+ * voltage. The ADC converts a single rail at a time, so the result of the
+ * previous round's selection is collected and the next rail selected;
+ * each voltage is refreshed every SPD5118_PMIC_RAILS rounds. Called with
+ * sample_lock held.
+ */
+static int spd5118_pmic_refill(struct spd5118_data *data, u8 *curr, u8 *volt,
+			       u8 *volt_valid)
+{
+	struct i2c_client *pmic = data->pmic;
+	unsigned int rail;
+	int ret;
+
+	ret = spd5118_read_block(pmic, SPD5118_CLASS_THERMAL, SPD5118_PMIC_REG_CURRENT,
+				 SPD5118_PMIC_RAILS, curr);
+	if (ret >= 0 && ret < SPD5118_PMIC_RAILS)
+		ret = -EIO;
+	if (ret < 0)
+		return ret;
+
+	ret = spd5118_read_byte(pmic, SPD5118_PMIC_REG_ADC_READ);
+	if (ret < 0)
+		return ret;
+	volt[data->pmic_rail] = ret;
+	*volt_valid |= BIT(data->pmic_rail);
+
+	/* Until the selection sticks, R31 still converts the same rail */
+	rail = (data->pmic_rail + 1) % SPD5118_PMIC_RAILS;
+	ret = spd5118_write_byte(pmic, SPD5118_PMIC_REG_ADC_CTRL,
+				 SPD5118_PMIC_ADC_ENABLE |
+				 FIELD_PREP(SPD5118_PMIC_ADC_SELECT, rail));
+	if (ret < 0)
+		return ret;
+
+	data->pmic_rail = rail;
+	return 0;
+}
+
+static const char * const spd5118_channel_labels[] = { "hub", "ts0", "ts1" };
+
+/*
+ * Log a change of a sensor's alarm bits, so excursions between two reads
+ * by userspace can still be found afterwards. Called with sample_lock held.
+ */
+static void spd5118_log_event(struct spd5118_data *data, int channel, u8 old_status)
+{
+	struct spd5118_event *ev;
+
+	if (data->sample.status[channel] == old_status)
+		return;
+
+	ev = &data->events[data->num_events++ & (SPD5118_NUM_EVENTS - 1)];
+	ev->time = data->sample.timestamp;
+	ev->temp = data->sample.temp[channel];
+	ev->channel = channel;
+	ev->old_status = old_status;
+	ev->new_status = data->sample.status[channel];
+}
+
+static int spd5118_events_show(struct seq_file *s, void *unused)
+{
+	struct spd5118_data *data = s->private;
+	struct spd5118_event *ev;
+	unsigned int i, n;
+
+	mutex_lock(&data->sample_lock);
+	n = min_t(unsigned int, data->num_events, SPD5118_NUM_EVENTS);
+	seq_printf(s, "# %u events, last %u shown\n", data->num_events, n);
+	seq_puts(s, "# timestamp_ns sensor temp old new\n");
+	for (i = data->num_events - n; i != data->num_events; i++) {
+		ev = &data->events[i & (SPD5118_NUM_EVENTS - 1)];
+		seq_printf(s, "%lld %s %d 0x%02x 0x%02x\n", ktime_to_ns(ev->time),
+			   spd5118_channel_labels[ev->channel],
+			   spd5118_temp_from_reg(ev->temp),
+			   ev->old_status, ev->new_status);
+	}
+	mutex_unlock(&data->sample_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(spd5118_events);
+
+/*
+ * In window mode the hub's high and low alarms only say the temperature
+ * left the window; the user's are worked out from the limits instead.
+ */
+static u8 spd5118_window_status(u16 temp, const u16 *limits, u8 hw_status)
+{
+	int t = spd5118_temp_from_reg(temp);
+	u8 status = hw_status & (SPD5118_TEMP_STATUS_CRIT | SPD5118_TEMP_STATUS_LCRIT);
+
+	if (t > spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MAX)]))
+		status |= SPD5118_TEMP_STATUS_HIGH;
+	if (t < spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MIN)]))
+		status |= SPD5118_TEMP_STATUS_LOW;
+
+	return status;
+}
+
+/*
+ * Pull a window edge in to any of the user's high and low limits between it
+ * and the reading, so crossing one always trips the window and the alarms
+ * computed by spd5118_window_status() stay exact.
+ */
+static int spd5118_window_edge(int t, int edge, const u16 *limits)
+{
+	static const int regs[] = { SPD5118_REG_TEMP_MAX, SPD5118_REG_TEMP_MIN };
+	int i, l;
+
+	for (i = 0; i < ARRAY_SIZE(regs); i++) {
+		l = spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(regs[i])]);
+		if ((edge > t && l >= t && l < edge) ||
+		    (edge < t && l <= t && l > edge))
+			edge = l;
+	}
+	return edge;
+}
+
+/*
+ * Move a sensor's window to its last reading and clear the trip. Called
+ * with limits_lock held, so the edges are pulled in to the limits in force.
+ */
+static int spd5118_window_move(struct spd5118_data *data, int ch)
+{
+	struct spd5118_sample sample;
+	u8 buf[4];
+	int t, ret;
+
+	spd5118_get_sample(data, &sample);
+
+	t = spd5118_temp_from_reg(sample.temp[ch]);
+	data->window[ch][0] = spd5118_temp_to_reg(
+		spd5118_window_edge(t, t + (int)window_mc, sample.limits[ch]));
+	data->window[ch][1] = spd5118_temp_to_reg(
+		spd5118_window_edge(t, t - (int)window_mc, sample.limits[ch]));
+
+	buf[0] = data->window[ch][0] & 0xff;
+	buf[1] = data->window[ch][0] >> 8;
+	buf[2] = data->window[ch][1] & 0xff;
+	buf[3] = data->window[ch][1] >> 8;
+	if (i2c_check_functionality(data->client->adapter,
+				    I2C_FUNC_SMBUS_WRITE_I2C_BLOCK))
+		ret = spd5118_write_block(data->channel[ch], SPD5118_CLASS_THERMAL,
+					  SPD5118_REG_TEMP_MAX, sizeof(buf), buf);
+	else
+		ret = spd5118_write_word(data->channel[ch], SPD5118_REG_TEMP_MAX,
+					 data->window[ch][0]) ?:
+		      spd5118_write_word(data->channel[ch], SPD5118_REG_TEMP_MIN,
+					 data->window[ch][1]);
+	if (ret >= 0)
+		ret = spd5118_write_byte(data->channel[ch], SPD5118_REG_TEMP_CLR,
+					 SPD5118_TEMP_CLR_HIGH | SPD5118_TEMP_CLR_LOW);
+	atomic64_add(sizeof(buf) + 1, &data->window_bytes);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Move every sensor's window to its last reading */
+static int spd5118_window_centre(struct spd5118_data *data)
+{
+	int ch, ret = 0;
+
+	mutex_lock(&data->limits_lock);
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS && !ret; ch++) {
+		if (data->channel[ch])
+			ret = spd5118_window_move(data, ch);
+	}
+
+	if (!ret) {
+		WRITE_ONCE(data->window_active, true);
+		data->limits_dirty = true;
+	}
+	mutex_unlock(&data->limits_lock);
+
+	return ret;
+}
+
+/*
+ * After a high or low limit change the hub only trips once the reading
+ * leaves the new window, so work the sensor's alarms out again right away.
+ * Called with limits_lock held.
+ */
+static void spd5118_window_restatus(struct spd5118_data *data, int ch)
+{
+	struct spd5118_sample sample;
+	u8 old;
+
+	mutex_lock(&data->sample_lock);
+	old = data->sample.status[ch];
+	write_seqcount_begin(&data->sample_seq);
+	data->sample.status[ch] = spd5118_window_status(data->sample.temp[ch],
+							data->sample.limits[ch], old);
+	data->sample.latched[ch] |= data->sample.status[ch];
+	write_seqcount_end(&data->sample_seq);
+	spd5118_log_event(data, ch, old);
+	sample = data->sample;
+	mutex_unlock(&data->sample_lock);
+
+	if (sample.status[ch] != old)
+		spd5118_genl_alarm(data, ch, old, &sample);
+}
+
+/* Read MR49:MR51 of every sensor on the module in one round and publish them */
+static int __spd5118_refill(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u8 old_status[SPD5118_NUM_CHANNELS];
+	u8 regs[SPD5118_NUM_CHANNELS][3];
+	u8 pmic_curr[SPD5118_PMIC_RAILS];
+	u8 pmic_volt[SPD5118_PMIC_RAILS];
+	u8 pmic_volt_valid;
+	struct spd5118_sample sample;
+	bool pmic_ok = false;
+	u8 status;
+	bool stale = false;
+	bool had_sample;
+	int ch, ret, err;
+
+	ret = spd5118_ts_get(client);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&data->sample_lock);
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+		if (!data->channel[ch])
+			continue;
+
+		ret = spd5118_read_block(data->channel[ch], SPD5118_CLASS_THERMAL,
+					 SPD5118_REG_TEMP, sizeof(regs[ch]), regs[ch]);
+		if (ret >= 0 && ret < sizeof(regs[ch]))
+			ret = -EIO;
+		if (ret < 0)
+			break;
+	}
+
+	/* A PMIC hiccup only leaves its readings at the previous round's */
+	if (ret >= 0 && data->pmic) {
+		memcpy(pmic_volt, data->sample.pmic_volt, sizeof(pmic_volt));
+		pmic_volt_valid = data->sample.pmic_volt_valid;
+		err = spd5118_pmic_refill(data, pmic_curr, pmic_volt,
+					  &pmic_volt_valid);
+		if (err < 0)
+			dev_warn_ratelimited(&client->dev,
+					     "PMIC telemetry read failed (%d)\n", err);
+		pmic_ok = !err;
+	}
+
+	had_sample = data->sample.timestamp;
+	memcpy(old_status, data->sample.status, sizeof(old_status));
+
+	write_seqcount_begin(&data->sample_seq);
+	if (ret >= 0) {
+		for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+			if (!data->channel[ch])
+				continue;
+			data->sample.temp[ch] = regs[ch][0] | regs[ch][1] << 8;
+			status = regs[ch][2];
+			if (READ_ONCE(data->window_active))
+				status = spd5118_window_status(data->sample.temp[ch],
+							       data->sample.limits[ch],
+							       status);
+			data->sample.status[ch] = status;
+			data->sample.latched[ch] |= status;
+		}
+		if (pmic_ok) {
+			memcpy(data->sample.pmic_curr, pmic_curr, sizeof(pmic_curr));
+			memcpy(data->sample.pmic_volt, pmic_volt, sizeof(pmic_volt));
+			data->sample.pmic_volt_valid = pmic_volt_valid;
+		}
+		data->sample.stale = false;
+		data->sample.timestamp = ktime_get();
+	} else if (spd5118_xfer_transient(ret) && data->sample.timestamp) {
+		/* Out of retries, keep handing out the last good sample */
+		data->sample.stale = stale = true;
+	}
+	write_seqcount_end(&data->sample_seq);
+	sample = data->sample;
+
+	/* Alarms already set on the first read count as transitions from clear */
+	for (ch = 0; ret >= 0 && ch < SPD5118_NUM_CHANNELS; ch++) {
+		if (data->channel[ch])
+			spd5118_log_event(data, ch, had_sample ? old_status[ch] : 0);
+	}
+
+	mutex_unlock(&data->sample_lock);
+
+	spd5118_ts_put(client);
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+		if (!data->channel[ch])
+			continue;
+
+		if (ret >= 0 || stale)
+			spd5118_ring_push(data, &sample, ch);
+
+		if (ret >= 0 && had_sample && sample.status[ch] != old_status[ch])
+			spd5118_genl_alarm(data, ch, old_status[ch], &sample);
+	}
+
+	if (stale) {
+		dev_warn_ratelimited(&client->dev,
+				     "Temperature read failed (%d), using last sample\n",
+				     ret);
+		atomic_inc(&data->stale_reads);
+		return 0;
+	}
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Coalesce concurrent refills: the first caller performs the transfer and
+ * everyone arriving while it is in flight waits for it and shares its
+ * result. A waiter that misses the completion of the transfer it saw ends
+ * up sharing the next one instead, which is only ever fresher.
+ */
+static int spd5118_refill(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int ret;
+
+	spin_lock(&data->flight_lock);
+	if (data->in_flight) {
+		spin_unlock(&data->flight_lock);
+		atomic_inc(&data->coalesced);
+		wait_for_completion(&data->flight_done);
+		spin_lock(&data->flight_lock);
+		ret = data->flight_ret;
+		spin_unlock(&data->flight_lock);
+		return ret;
+	}
+	data->in_flight = true;
+	reinit_completion(&data->flight_done);
+	spin_unlock(&data->flight_lock);
+
+	ret = __spd5118_refill(client);
+
+	spin_lock(&data->flight_lock);
+	data->in_flight = false;
+	data->flight_ret = ret;
+	complete_all(&data->flight_done);
+	spin_unlock(&data->flight_lock);
+
+	return ret;
+}
+
+/* The background sampler keeps the sample fresh, so allow it some slack */
+static unsigned int spd5118_max_age_ms(void)
+{
+	return max(cache_ms, 2 * sample_interval_ms);
+}
+
+static int spd5118_read_sample(struct i2c_client *client,
+			       struct spd5118_sample *sample)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int ret;
+
+	spd5118_get_sample(data, sample);
+	if (sample->timestamp &&
+	    ktime_ms_delta(ktime_get(), sample->timestamp) < spd5118_max_age_ms())
+		return 0;
+
+	ret = spd5118_refill(client);
+	if (ret < 0)
+		return ret;
+
+	spd5118_get_sample(data, sample);
+	return 0;
+}
+
+static int spd5118_read_temp(struct i2c_client *client, u32 attr, int channel,
+			     long *val)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	struct spd5118_sample sample;
+	int reg, ret;
+
+	switch (attr) {
+	case hwmon_temp_input:
+		ret = spd5118_read_sample(client, &sample);
+		if (ret < 0)
+			return ret;
+		*val = spd5118_temp_from_reg(sample.temp[channel]);
+		return 0;
+	case hwmon_temp_max:
+		reg = SPD5118_REG_TEMP_MAX;
+		break;
+	case hwmon_temp_min:
+		reg = SPD5118_REG_TEMP_MIN;
+		break;
+	case hwmon_temp_crit:
+		reg = SPD5118_REG_TEMP_CRIT;
+		break;
+	case hwmon_temp_lcrit:
+		reg = SPD5118_REG_TEMP_LCRIT;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	/* Limits only change through us, so the register cache is authoritative */
+	spd5118_get_sample(data, &sample);
+	*val = spd5118_temp_from_reg(sample.limits[channel][SPD5118_LIMIT_INDEX(reg)]);
+	return 0;
+}
+
+static int spd5118_write_temp(struct i2c_client *client, u32 attr, int channel,
+			      long val)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int reg, ret;
+	u16 regval;
+
+	if (WARN_ON(!enable_temp_write))
+		return -EOPNOTSUPP;
+
+	switch (attr) {
+	case hwmon_temp_max:
+		reg = SPD5118_REG_TEMP_MAX;
+		break;
+	case hwmon_temp_min:
+		reg = SPD5118_REG_TEMP_MIN;
+		break;
+	case hwmon_temp_crit:
+		reg = SPD5118_REG_TEMP_CRIT;
+		break;
+	case hwmon_temp_lcrit:
+		reg = SPD5118_REG_TEMP_LCRIT;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	regval = spd5118_temp_to_reg(val);
+	mutex_lock(&data->limits_lock);
+	/* The window owns MR28:MR31, the user's high and low only live here */
+	if (data->window_active &&
+	    (reg == SPD5118_REG_TEMP_MAX || reg == SPD5118_REG_TEMP_MIN))
+		ret = 0;
+	else
+		ret = spd5118_write_word(data->channel[channel], reg, regval);
+	if (!ret) {
+		mutex_lock(&data->sample_lock);
+		write_seqcount_begin(&data->sample_seq);
+		data->sample.limits[channel][SPD5118_LIMIT_INDEX(reg)] = regval;
+		write_seqcount_end(&data->sample_seq);
+		mutex_unlock(&data->sample_lock);
+		data->limits_dirty = true;
+
+		if (data->window_active &&
+		    (reg == SPD5118_REG_TEMP_MAX || reg == SPD5118_REG_TEMP_MIN)) {
+			ret = spd5118_window_move(data, channel);
+			spd5118_window_restatus(data, channel);
+		}
+	}
+	mutex_unlock(&data->limits_lock);
+	return ret;
+}
+
+/*
+ * What MR28:MR35 of a sensor should hold: the user's limits, with the
+ * window in place of high and low in window mode. Called with limits_lock
+ * held.
+ */
+static void spd5118_hw_limits(struct spd5118_data *data, int channel,
+			      const u16 *limits, u16 *hw)
+{
+	memcpy(hw, limits, SPD5118_NUM_LIMITS * sizeof(*hw));
+	if (data->window_active) {
+		hw[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MAX)] = data->window[channel][0];
+		hw[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MIN)] = data->window[channel][1];
+	}
+}
+
+/* Program all of MR28:MR35, in a single block write where the adapter can */
+static int spd5118_write_limits(struct i2c_client *client, const u16 *limits)
+{
+	u8 buf[SPD5118_NUM_LIMITS * 2];
+	int i, ret;
+
+	if (i2c_check_functionality(client->adapter,
+				    I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+		for (i = 0; i < SPD5118_NUM_LIMITS; i++) {
+			buf[2 * i] = limits[i] & 0xff;
+			buf[2 * i + 1] = limits[i] >> 8;
+		}
+		return spd5118_write_block(client, SPD5118_CLASS_THERMAL,
+					   SPD5118_REG_TEMP_MAX, sizeof(buf), buf);
+	}
+
+	for (i = 0; i < SPD5118_NUM_LIMITS; i++) {
+		ret = spd5118_write_word(client, SPD5118_REG_TEMP_MAX + 2 * i,
+					 limits[i]);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int spd5118_alarm_mask(u32 attr)
+{
+	switch (attr) {
+	case hwmon_temp_max_alarm:
+		return SPD5118_TEMP_STATUS_HIGH;
+	case hwmon_temp_min_alarm:
+		return SPD5118_TEMP_STATUS_LOW;
+	case hwmon_temp_crit_alarm:
+		return SPD5118_TEMP_STATUS_CRIT;
+	case hwmon_temp_lcrit_alarm:
+		return SPD5118_TEMP_STATUS_LCRIT;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int spd5118_read_alarm(struct i2c_client *client, u32 attr, int channel,
+			      long *val)
+{
+	struct spd5118_sample sample;
+	int mask, ret;
+	u8 status;
+
+	mask = spd5118_alarm_mask(attr);
+	if (mask < 0)
+		return mask;
+
+	ret = spd5118_read_sample(client, &sample);
+	if (ret < 0)
+		return ret;
+
+	status = sample.status[channel];
+	if (alarm_latch)
+		status |= sample.latched[channel];
+
+	*val = !!(status & mask);
+	return 0;
+}
+
+/*
+ * Acknowledge a latched alarm. This only forgets what the sampler has seen,
+ * so it needs no bus access; a condition that persists is still reported
+ * through the last read's MR51 and latches again on the next one.
+ */
+static int spd5118_ack_alarm(struct i2c_client *client, u32 attr, int channel)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int mask;
+
+	mask = spd5118_alarm_mask(attr);
+	if (mask < 0)
+		return mask;
+
+	mutex_lock(&data->sample_lock);
+	write_seqcount_begin(&data->sample_seq);
+	data->sample.latched[channel] &= ~mask;
+	write_seqcount_end(&data->sample_seq);
+	mutex_unlock(&data->sample_lock);
+
+	return 0;
+}
+
+static int spd5118_clear_alarm(struct i2c_client *client, u32 attr, int channel)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u8 regval;
+
+	if (WARN_ON(!enable_alarm_write))
+		return -EOPNOTSUPP;
+
+	switch (attr) {
+	case hwmon_temp_max_alarm:
+		regval = SPD5118_TEMP_CLR_HIGH;
+		break;
+	case hwmon_temp_min_alarm:
+		regval = SPD5118_TEMP_CLR_LOW;
+		break;
+	case hwmon_temp_crit_alarm:
+		regval = SPD5118_TEMP_CLR_CRIT;
+		break;
+	case hwmon_temp_lcrit_alarm:
+		regval = SPD5118_TEMP_CLR_LCRIT;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return spd5118_write_byte(data->channel[channel], SPD5118_REG_TEMP_CLR, regval);
+}
+
+/* Rail voltage in mV, current in mA and power in uW */
+static int spd5118_read_pmic(struct i2c_client *client,
+			     enum hwmon_sensor_types type, int channel, long *val)
+{
+	struct spd5118_sample sample;
+	long mv, ma;
+	int ret;
+
+	ret = spd5118_read_sample(client, &sample);
+	if (ret < 0)
+		return ret;
+
+	/* Until the ADC got round to a rail its voltage is unknown */
+	if (type != hwmon_curr && !(sample.pmic_volt_valid & BIT(channel)))
+		return -ENODATA;
+
+	mv = sample.pmic_volt[channel] * SPD5118_PMIC_VOLTAGE_LSB_MV;
+	ma = FIELD_GET(SPD5118_PMIC_CURRENT_MASK, sample.pmic_curr[channel]) *
+	     SPD5118_PMIC_CURRENT_LSB_MA;
+
+	switch (type) {
+	case hwmon_in:
+		*val = mv;
+		return 0;
+	case hwmon_curr:
+		*val = ma;
+		return 0;
+	case hwmon_power:
+		*val = mv * ma;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int spd5118_read(struct device *dev, enum hwmon_sensor_types type,
+		     u32 attr, int channel, long *val)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+
+	switch (type) {
+	case hwmon_in:
+	case hwmon_curr:
+	case hwmon_power:
+		return spd5118_read_pmic(client, type, channel, val);
+	case hwmon_temp:
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	switch (attr) {
+	case hwmon_temp_input:
+	case hwmon_temp_max:
+	case hwmon_temp_min:
+	case hwmon_temp_crit:
+	case hwmon_temp_lcrit:
+		return spd5118_read_temp(client, attr, channel, val);
+	case hwmon_temp_fault:
+		*val = test_bit(SPD5118_OFFLINE, &data->flags);
+		return 0;
+	case hwmon_temp_max_alarm:
+	case hwmon_temp_min_alarm:
+	case hwmon_temp_crit_alarm:
+	case hwmon_temp_lcrit_alarm:
+		return spd5118_read_alarm(client, attr, channel, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int spd5118_write(struct device *dev, enum hwmon_sensor_types type,
+		      u32 attr, int channel, long val)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+
+	if (type != hwmon_temp)
+		return -EOPNOTSUPP;
+
+	switch (attr) {
+	case hwmon_temp_max:
+	case hwmon_temp_min:
+	case hwmon_temp_crit:
+	case hwmon_temp_lcrit:
+		return spd5118_write_temp(client, attr, channel, val);
+	case hwmon_temp_max_alarm:
+	case hwmon_temp_min_alarm:
+	case hwmon_temp_crit_alarm:
+	case hwmon_temp_lcrit_alarm:
+		if (val)
+			return -EINVAL;
+		if (alarm_latch)
+			return spd5118_ack_alarm(client, attr, channel);
+		return spd5118_clear_alarm(client, attr, channel);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char * const spd5118_rail_labels[] = { "swa", "swb", "swc", "swd" };
+
+static int spd5118_read_string(struct device *dev, enum hwmon_sensor_types type,
+			       u32 attr, int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		*str = spd5118_channel_labels[channel];
+		return 0;
+	case hwmon_in:
+	case hwmon_curr:
+	case hwmon_power:
+		*str = spd5118_rail_labels[channel];
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static umode_t spd5118_is_visible(const void *_data, enum hwmon_sensor_types type,
+			       u32 attr, int channel)
+{
+	const struct spd5118_data *data = i2c_get_clientdata(_data);
+
+	switch (type) {
+	case hwmon_in:
+	case hwmon_curr:
+	case hwmon_power:
+		return data->pmic ? 0444 : 0;
+	case hwmon_temp:
+		break;
+	default:
+		return 0;
+	}
+
+	if (!data->channel[channel])
+		return 0;
+
+	switch (attr) {
+	case hwmon_temp_input:
+	case hwmon_temp_label:
+	case hwmon_temp_fault:
+		return 0444;
+	case hwmon_temp_min:
+	case hwmon_temp_max:
+	case hwmon_temp_crit:
+	case hwmon_temp_lcrit:
+		return enable_temp_write ? 0644 : 0444;
+	case hwmon_temp_min_alarm:
+	case hwmon_temp_max_alarm:
+	case hwmon_temp_crit_alarm:
+	case hwmon_temp_lcrit_alarm:
+		return enable_alarm_write || alarm_latch ? 0644 : 0444;
+	default:
+		return 0;
+	}
+}
+
+static ssize_t
+temp1_stale_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	struct spd5118_sample sample;
+
+	spd5118_get_sample(data, &sample);
+	return sprintf(buf, "%d\n", sample.stale);
+}
+
+static DEVICE_ATTR_RO(temp1_stale);
+
+/*
+ * When, on CLOCK_MONOTONIC, the hub was last read and how long ago that
+ * was. Neither touches the bus, so consumers can check them first and only
+ * read temp1_input when the sample is older than they can tolerate.
+ */
+static ssize_t
+temp1_timestamp_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	struct spd5118_sample sample;
+
+	spd5118_get_sample(data, &sample);
+	return sprintf(buf, "%lld\n", ktime_to_ns(sample.timestamp));
+}
+
+static DEVICE_ATTR_RO(temp1_timestamp);
+
+static ssize_t
+temp1_age_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	struct spd5118_sample sample;
+
+	spd5118_get_sample(data, &sample);
+	if (!sample.timestamp)
+		return -ENODATA;
+	return sprintf(buf, "%lld\n", ktime_ms_delta(ktime_get(), sample.timestamp));
+}
+
+static DEVICE_ATTR_RO(temp1_age_ms);
+
+/*
+ * All four thresholds at once, as "lcrit min max crit" in millicelsius.
+ * A write is checked for ordering and lands in MR28:MR35 with one block
+ * write, so the hub never sees a half updated set of limits.
+ */
+static ssize_t
+temp1_limits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	struct spd5118_sample sample;
+	u16 *limits = sample.limits[0];
+
+	spd5118_get_sample(data, &sample);
+	return sprintf(buf, "%d %d %d %d\n",
+		       spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_LCRIT)]),
+		       spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MIN)]),
+		       spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MAX)]),
+		       spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_CRIT)]));
+}
+
+static ssize_t
+temp1_limits_store(struct device *dev, struct device_attribute *attr,
+		   const char *buf, size_t count)
+{
+	struct i2c_client *client = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u16 limits[SPD5118_NUM_LIMITS], hw[SPD5118_NUM_LIMITS];
+	long lcrit, min, max, crit;
+	int ret;
+
+	if (!enable_temp_write)
+		return -EOPNOTSUPP;
+
+	if (sscanf(buf, "%ld %ld %ld %ld", &lcrit, &min, &max, &crit) != 4)
+		return -EINVAL;
+
+	limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_LCRIT)] = spd5118_temp_to_reg(lcrit);
+	limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MIN)] = spd5118_temp_to_reg(min);
+	limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MAX)] = spd5118_temp_to_reg(max);
+	limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_CRIT)] = spd5118_temp_to_reg(crit);
+
+	/* Compare what the hub will hold, after clamping and rounding */
+	lcrit = spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_LCRIT)]);
+	min = spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MIN)]);
+	max = spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_MAX)]);
+	crit = spd5118_temp_from_reg(limits[SPD5118_LIMIT_INDEX(SPD5118_REG_TEMP_CRIT)]);
+	if (lcrit > min || min > max || max > crit)
+		return -EINVAL;
+
+	mutex_lock(&data->limits_lock);
+	spd5118_hw_limits(data, 0, limits, hw);
+	ret = spd5118_write_limits(client, hw);
+	if (!ret) {
+		mutex_lock(&data->sample_lock);
+		write_seqcount_begin(&data->sample_seq);
+		memcpy(data->sample.limits[0], limits, sizeof(limits));
+		write_seqcount_end(&data->sample_seq);
+		mutex_unlock(&data->sample_lock);
+		data->limits_dirty = true;
+
+		if (data->window_active) {
+			ret = spd5118_window_move(data, 0);
+			spd5118_window_restatus(data, 0);
+		}
+	}
+	mutex_unlock(&data->limits_lock);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_RW(temp1_limits);
+
+static struct attribute *spd5118_hwmon_attrs[] = {
+	&dev_attr_temp1_stale.attr,
+	&dev_attr_temp1_timestamp.attr,
+	&dev_attr_temp1_age_ms.attr,
+	&dev_attr_temp1_limits.attr,
+	NULL,
+};
+
+static umode_t spd5118_hwmon_attr_is_visible(struct kobject *kobj,
+					     struct attribute *attr, int n)
+{
+	if (attr == &dev_attr_temp1_limits.attr)
+		return enable_temp_write ? 0644 : 0444;
+	return attr->mode;
+}
+
+static const struct attribute_group spd5118_hwmon_group = {
+	.attrs = spd5118_hwmon_attrs,
+	.is_visible = spd5118_hwmon_attr_is_visible,
+};
+
+static const struct attribute_group *spd5118_hwmon_groups[] = {
+	&spd5118_hwmon_group,
+	NULL,
+};
+
+static ssize_t
+revision_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spd5118_data *data = dev_get_drvdata(dev);
+	/* From JESD300-5B
+	 *   MR2 bits [5:4]: Major revision, 1..4
+	 *   MR2 bits [3:1]: Minor revision, 0..8? Probably a typo.
+	 */
+	return sprintf(buf, "%d.%d\n", 1 + ((data->revision >> 4) & 3), (data->revision >> 1) & 7);
+}
+
+static DEVICE_ATTR_RO(revision);
+
+/* Print a JEP106 ID whose low byte is the number of 7F prefixes */
+static ssize_t spd5118_jep106_show(char *buf, u16 code)
+{
+	u8 pfx = code & 0x7f;
+	u8 id = (code >> 8) & 0x7f;
+	int n = 0;
+
+	while (pfx--) {
+		n += 3;
+		*buf++ = '7';
+		*buf++ = 'F';
+		*buf++ = ' ';
+	}
+	return n + sprintf(buf, "%02X\n", id);
+}
+
+static ssize_t
+pmic_vendor_id_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spd5118_data *data = dev_get_drvdata(dev);
+
+	return spd5118_jep106_show(buf, data->vendor);
+}
+
+static DEVICE_ATTR_RO(pmic_vendor_id);
+
+static int spd5118_set_current_page(struct i2c_client *client, int page)
+{
+	struct device *dev = &client->dev;
+	struct spd5118_data *data = dev_get_drvdata(dev);
+	union i2c_smbus_data smbus = { .byte = page };
+	int ret;
+
+	if (page == data->current_page)
+		return 0;
+
+	ret = spd5118_xfer(client, SPD5118_CLASS_BULK, I2C_SMBUS_WRITE,
+			   SPD5118_REG_I2C_LEGACY_MODE, I2C_SMBUS_BYTE_DATA, &smbus);
+	if (ret < 0) {
+		dev_err(dev, "Failed to select page %d (%d)\n", page, ret);
+		return ret;
+	}
+
+	dev_dbg(dev, "Selected page %d\n", page);
+	data->current_page = page;
+
+	return 0;
+}
+
+/* Read a whole page into the EEPROM shadow, called with page_lock held */
+static int spd5118_eeprom_fill_page(struct i2c_client *client, int page)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u8 *buf = &data->eeprom[page << SPD5118_PAGE_SHIFT];
+	int ret, offset = 0;
+
+	if (test_bit(page, &data->eeprom_valid))
+		return 0;
+
+	ret = spd5118_set_current_page(client, page);
+	if (ret)
+		return ret;
+
+	while (offset < SPD5118_PAGE_SIZE) {
+		ret = spd5118_read_block(client, SPD5118_CLASS_BULK,
+					 SPD5118_EEPROM_BASE + offset,
+					 SPD5118_PAGE_SIZE - offset, buf + offset);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+		offset += ret;
+	}
+
+	set_bit(page, &data->eeprom_valid);
+	return 0;
+}
+
+static ssize_t spd5118_eeprom_read(struct i2c_client *client, char *buf,
+				  unsigned int offset, size_t count)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int status, page;
+
+	page = offset >> SPD5118_PAGE_SHIFT;
+
+	/* The hub is only read once per page, later reads hit the shadow */
+	status = spd5118_eeprom_fill_page(client, page);
+	if (status)
+		return status;
+
+	/* Can't cross page boundaries */
+	if ((offset & (SPD5118_PAGE_SIZE - 1)) + count > SPD5118_PAGE_SIZE)
+		count = SPD5118_PAGE_SIZE - (offset & (SPD5118_PAGE_SIZE - 1));
+
+	memcpy(buf, &data->eeprom[offset], count);
+	return count;
+}
+
+static ssize_t eeprom_read(struct file *filp, struct kobject *kobj,
+			   struct bin_attribute *bin_attr,
+			   char *buf, loff_t off, size_t count)
+{
+	struct i2c_client *client = kobj_to_i2c_client(kobj);
+	struct device *dev = &client->dev;
+	struct spd5118_data *data = dev_get_drvdata(dev);
+	size_t requested = count;
+	int ret = 0;
+
+	mutex_lock(&data->page_lock);
+
+	while (count) {
+		ret = spd5118_eeprom_read(client, buf, off, count);
+		if (ret < 0)
+			goto out;
+
+		buf += ret;
+		off += ret;
+		count -= ret;
+	}
+out:
+
+	mutex_unlock(&data->page_lock);
+
+	return ret < 0 ? ret : requested;
+}
+
+static const char * const spd5118_module_types[16] = {
+	[1] = "RDIMM", [2] = "UDIMM", [3] = "SODIMM", [4] = "LRDIMM",
+	[5] = "CUDIMM", [6] = "CSODIMM", [7] = "MRDIMM", [8] = "CAMM2",
+	[10] = "DDIMM", [11] = "Solder down",
+};
+
+static const unsigned int spd5118_die_per_package[8] = { 1, 0, 2, 4, 8, 16, 0, 0 };
+static const unsigned int spd5118_density_gbit[16] = {
+	0, 4, 8, 12, 16, 24, 32, 48, 64,
+};
+
+static void spd5118_spd_decode(const u8 *spd, struct spd5118_spd *dec)
+{
+	unsigned int io_width, bus_width, channels, dies, density;
+	int i;
+
+	dec->manufacturer = spd[SPD_DDR5_MFG_ID] | spd[SPD_DDR5_MFG_ID + 1] << 8;
+	dec->dram_manufacturer = spd[SPD_DDR5_DRAM_MFG_ID] |
+				 spd[SPD_DDR5_DRAM_MFG_ID + 1] << 8;
+	dec->module_type = spd[SPD_DDR5_MODULE_TYPE] & 0x0f;
+	dec->year = spd[SPD_DDR5_MFG_YEAR];
+	dec->week = spd[SPD_DDR5_MFG_WEEK];
+	dec->serial = (u32)spd[SPD_DDR5_SERIAL] << 24 |
+		      spd[SPD_DDR5_SERIAL + 1] << 16 |
+		      spd[SPD_DDR5_SERIAL + 2] << 8 |
+		      spd[SPD_DDR5_SERIAL + 3];
+
+	memcpy(dec->part_number, &spd[SPD_DDR5_PART_NUMBER], SPD_DDR5_PART_NUMBER_LEN);
+	for (i = SPD_DDR5_PART_NUMBER_LEN; i > 0; i--) {
+		if (dec->part_number[i - 1] != ' ' && dec->part_number[i - 1])
+			break;
+	}
+	dec->part_number[i] = '\0';
+
+	/* Geometry of the first SDRAM type; asymmetric modules are rare */
+	dec->ranks = ((spd[SPD_DDR5_ORGANIZATION] >> 3) & 7) + 1;
+	io_width = 4 << ((spd[SPD_DDR5_IO_WIDTH] >> 5) & 7);
+	bus_width = 8 << (spd[SPD_DDR5_BUS_WIDTH] & 7);
+	channels = ((spd[SPD_DDR5_BUS_WIDTH] >> 5) & 3) + 1;
+	dies = spd5118_die_per_package[(spd[SPD_DDR5_DENSITY] >> 5) & 7];
+	density = spd5118_density_gbit[spd[SPD_DDR5_DENSITY] & 0x0f];
+	if (spd[SPD_DDR5_DENSITY] & 0x10)
+		density = 0;
+
+	/* channels * chips per rank * ranks * Gbit per package, in MiB */
+	dec->capacity_mb = channels * (bus_width / io_width) * dec->ranks *
+			   dies * density * 128;
+
+	dec->tck_ps = spd[SPD_DDR5_TCK_MIN] | spd[SPD_DDR5_TCK_MIN + 1] << 8;
+	dec->speed = dec->tck_ps ? rounddown(2000000 / dec->tck_ps, 100) : 0;
+}
+
+/*
+ * Decode the SPD once, reading the two pages it needs into the shadow if
+ * eeprom_read() hasn't done so already. Called with page_lock held.
+ */
+static const struct spd5118_spd *spd5118_spd_get(struct i2c_client *client)
+{
+	/* Only the pages holding fields spd5118_spd_decode() uses */
+	static const unsigned int pages[] = {
+		SPD_DDR5_DEVICE_TYPE >> SPD5118_PAGE_SHIFT,
+		SPD_DDR5_ORGANIZATION >> SPD5118_PAGE_SHIFT,
+		SPD_DDR5_MFG_ID >> SPD5118_PAGE_SHIFT,
+	};
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int i, ret;
+
+	if (data->spd_valid)
+		return &data->spd;
+
+	for (i = 0; i < ARRAY_SIZE(pages); i++) {
+		ret = spd5118_eeprom_fill_page(client, pages[i]);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+
+	if (data->eeprom[SPD_DDR5_DEVICE_TYPE] != SPD_DDR5_TYPE_SDRAM)
+		return ERR_PTR(-ENODATA);
+
+	spd5118_spd_decode(data->eeprom, &data->spd);
+	data->spd_valid = true;
+	return &data->spd;
+}
+
+/*
+ * The base configuration block is protected by a CRC16 (polynomial 0x1021,
+ * initial value 0), which is exactly CRC-ITU-T as the kernel computes it with
+ * its lookup table. Called with page_lock held, the result is kept with the
+ * shadow.
+ */
+static int spd5118_crc_check(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int page, ret;
+
+	if (data->crc_checked)
+		return 0;
+
+	for (page = 0; page <= SPD_DDR5_CRC >> SPD5118_PAGE_SHIFT; page++) {
+		ret = spd5118_eeprom_fill_page(client, page);
+		if (ret)
+			return ret;
+	}
+
+	data->crc_computed = crc_itu_t(0, data->eeprom, SPD_DDR5_CRC);
+	data->crc_stored = data->eeprom[SPD_DDR5_CRC] |
+			   data->eeprom[SPD_DDR5_CRC + 1] << 8;
+	data->crc_checked = true;
+	return 0;
+}
+
+#define SPD5118_CRC_ATTR(_name, _fmt, _val)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{										\
+	struct i2c_client *client = to_i2c_client(dev);				\
+	struct spd5118_data *data = i2c_get_clientdata(client);			\
+	ssize_t ret;								\
+										\
+	mutex_lock(&data->page_lock);						\
+	ret = spd5118_crc_check(client);					\
+	if (!ret)								\
+		ret = sprintf(buf, _fmt "\n", _val);				\
+	mutex_unlock(&data->page_lock);						\
+	return ret;								\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+SPD5118_CRC_ATTR(spd_crc_valid, "%d", data->crc_stored == data->crc_computed);
+SPD5118_CRC_ATTR(spd_crc_stored, "0x%04x", data->crc_stored);
+SPD5118_CRC_ATTR(spd_crc_computed, "0x%04x", data->crc_computed);
+
+#define SPD5118_SPD_ATTR(_name, _fmt, ...)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{										\
+	struct i2c_client *client = to_i2c_client(dev);				\
+	struct spd5118_data *data = i2c_get_clientdata(client);			\
+	const struct spd5118_spd *spd;						\
+	ssize_t ret;								\
+										\
+	mutex_lock(&data->page_lock);						\
+	spd = spd5118_spd_get(client);						\
+	if (IS_ERR(spd))							\
+		ret = PTR_ERR(spd);						\
+	else									\
+		ret = sprintf(buf, _fmt "\n", __VA_ARGS__);			\
+	mutex_unlock(&data->page_lock);						\
+	return ret;								\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+SPD5118_SPD_ATTR(spd_part_number, "%s", spd->part_number);
+SPD5118_SPD_ATTR(spd_serial, "%08X", spd->serial);
+SPD5118_SPD_ATTR(spd_manufacture_date, "20%02x-W%02x", spd->year, spd->week);
+SPD5118_SPD_ATTR(spd_module_type, "%s",
+		 spd5118_module_types[spd->module_type] ?: "unknown");
+SPD5118_SPD_ATTR(spd_capacity_mb, "%u", spd->capacity_mb);
+SPD5118_SPD_ATTR(spd_ranks, "%u", spd->ranks);
+SPD5118_SPD_ATTR(spd_tck_min_ps, "%u", spd->tck_ps);
+SPD5118_SPD_ATTR(spd_speed, "%u", spd->speed);
+
+static ssize_t spd5118_spd_jep106_show(struct device *dev, char *buf, bool dram)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	const struct spd5118_spd *spd;
+	ssize_t ret;
+
+	mutex_lock(&data->page_lock);
+	spd = spd5118_spd_get(client);
+	if (IS_ERR(spd))
+		ret = PTR_ERR(spd);
+	else
+		ret = spd5118_jep106_show(buf, dram ? spd->dram_manufacturer :
+						      spd->manufacturer);
+	mutex_unlock(&data->page_lock);
+	return ret;
+}
 
-	page = offset >> SPD5118_PAGE_SHIFT;
-	offset &= (1 << SPD5118_PAGE_SHIFT) - 1;
+static ssize_t
+spd_manufacturer_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return spd5118_spd_jep106_show(dev, buf, false);
+}
 
-	status = spd5118_set_current_page(client, page);
-	if (status)
-		return status;
+static DEVICE_ATTR_RO(spd_manufacturer);
 
-	/* Can't cross page boundaries */
-	if (offset + count > SPD5118_PAGE_SIZE)
-		count = SPD5118_PAGE_SIZE - offset;
+static ssize_t
+spd_dram_manufacturer_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return spd5118_spd_jep106_show(dev, buf, true);
+}
+
+static DEVICE_ATTR_RO(spd_dram_manufacturer);
+
+/* Wait for the hub to finish its internal NVM write cycle */
+static int spd5118_eeprom_wait_write(struct i2c_client *client)
+{
+	ktime_t timeout = ktime_add_us(ktime_get(), SPD5118_WRITE_TIMEOUT_US);
+	union i2c_smbus_data smbus;
+	int ret;
+
+	for (;;) {
+		ret = spd5118_xfer(client, SPD5118_CLASS_BULK, I2C_SMBUS_READ,
+				   SPD5118_REG_DEV_STATUS, I2C_SMBUS_BYTE_DATA, &smbus);
+		if (ret < 0)
+			return ret;
+		if (!(smbus.byte & SPD5118_STATUS_WRITE_BUSY))
+			return 0;
+		if (ktime_after(ktime_get(), timeout))
+			return -ETIMEDOUT;
+		fsleep(SPD5118_WRITE_POLL_US);
+	}
+}
+
+/* Write within one page, as much as the hub takes in one go */
+static ssize_t spd5118_eeprom_write(struct i2c_client *client, const char *buf,
+				   unsigned int offset, size_t count)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	unsigned int in_page = offset & (SPD5118_PAGE_SIZE - 1);
+	int ret;
+
+	ret = spd5118_set_current_page(client, offset >> SPD5118_PAGE_SHIFT);
+	if (ret)
+		return ret;
 
-	return i2c_smbus_read_i2c_block_data_or_emulated(client, SPD5118_EEPROM_BASE + offset, count, buf);
+	if (i2c_check_functionality(client->adapter,
+				    I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+		count = min_t(size_t, count,
+			      SPD5118_WRITE_SIZE - (offset & (SPD5118_WRITE_SIZE - 1)));
+		ret = spd5118_write_block(client, SPD5118_CLASS_BULK,
+					  SPD5118_EEPROM_BASE + in_page, count, buf);
+	} else {
+		/* One write cycle per byte, slow but fine for lab use */
+		union i2c_smbus_data smbus = { .byte = buf[0] };
+
+		count = 1;
+		ret = spd5118_xfer(client, SPD5118_CLASS_BULK, I2C_SMBUS_WRITE,
+				   SPD5118_EEPROM_BASE + in_page,
+				   I2C_SMBUS_BYTE_DATA, &smbus);
+	}
+	if (ret < 0)
+		return ret;
+
+	ret = spd5118_eeprom_wait_write(client);
+	if (ret < 0)
+		return ret;
+
+	memcpy(&data->eeprom[offset], buf, count);
+	return count;
 }
 
-static ssize_t eeprom_read(struct file *filp, struct kobject *kobj,
-			   struct bin_attribute *bin_attr,
-			   char *buf, loff_t off, size_t count)
+static ssize_t eeprom_write(struct file *filp, struct kobject *kobj,
+			    struct bin_attribute *bin_attr,
+			    char *buf, loff_t off, size_t count)
 {
 	struct i2c_client *client = kobj_to_i2c_client(kobj);
-	struct device *dev = &client->dev;
-	struct spd5118_data *data = dev_get_drvdata(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	union i2c_smbus_data smbus;
 	size_t requested = count;
-	int ret = 0;
+	unsigned int block;
+	int ret;
+
+	if (WARN_ON(!enable_eeprom_write))
+		return -EOPNOTSUPP;
+	if (!count)
+		return 0;
 
-	mutex_lock(&data->update_lock);
+	mutex_lock(&data->page_lock);
+
+	/* Refuse up front rather than fail halfway through */
+	ret = spd5118_xfer(client, SPD5118_CLASS_BULK, I2C_SMBUS_READ,
+			   SPD5118_REG_WRITE_PROTECT, I2C_SMBUS_WORD_DATA, &smbus);
+	if (ret < 0)
+		goto out;
+
+	for (block = off >> SPD5118_WP_BLOCK_SHIFT;
+	     block <= (off + count - 1) >> SPD5118_WP_BLOCK_SHIFT; block++) {
+		if (smbus.word & BIT(block)) {
+			ret = -EROFS;
+			goto out;
+		}
+	}
+
+	/* Anything derived from the shadow has to be decoded again */
+	data->spd_valid = false;
+	data->crc_checked = false;
 
 	while (count) {
-		ret = spd5118_eeprom_read(client, buf, off, count);
+		ret = spd5118_eeprom_write(client, buf, off, count);
 		if (ret < 0)
-			goto out;
+			break;
 
 		buf += ret;
 		off += ret;
 		count -= ret;
 	}
-out:
 
-	mutex_unlock(&data->update_lock);
+	if (count != requested) {
+		data->eeprom_generation++;
+		data->hash_valid = false;
+	}
+out:
+	mutex_unlock(&data->page_lock);
 
 	return ret < 0 ? ret : requested;
 }
 
-static BIN_ATTR_RO(eeprom, SPD5118_EEPROM_SIZE);
+/*
+ * Fingerprint of a module: the stored base block CRC in the upper half, a
+ * CRC of the manufacturer ID, location, date and serial in the lower one.
+ */
+static u32 spd5118_key_hash(const u8 *key)
+{
+	return (u32)(key[0] | key[1] << 8) << 16 | crc_itu_t(0, key + 2, SPD_DDR5_KEY_LEN - 2);
+}
+
+static bool spd5118_key_shadowed(struct spd5118_data *data)
+{
+	return test_bit(SPD_DDR5_KEY >> SPD5118_PAGE_SHIFT, &data->eeprom_valid) &&
+	       test_bit((SPD_DDR5_KEY + SPD_DDR5_KEY_LEN - 1) >> SPD5118_PAGE_SHIFT,
+			&data->eeprom_valid);
+}
+
+/*
+ * Read the key bytes, from the shadow if it has them and from the hub
+ * otherwise, or always from the hub with @from_hub. Called with page_lock
+ * held.
+ */
+static int spd5118_read_key(struct i2c_client *client, u8 *key, bool from_hub)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	unsigned int offset = SPD_DDR5_KEY, len = SPD_DDR5_KEY_LEN;
+	unsigned int page, chunk;
+	int ret;
+
+	if (!from_hub && spd5118_key_shadowed(data)) {
+		memcpy(key, &data->eeprom[SPD_DDR5_KEY], SPD_DDR5_KEY_LEN);
+		return 0;
+	}
+
+	while (len) {
+		page = offset >> SPD5118_PAGE_SHIFT;
+		chunk = min(len, SPD5118_PAGE_SIZE - (offset & (SPD5118_PAGE_SIZE - 1)));
+
+		ret = spd5118_set_current_page(client, page);
+		if (ret)
+			return ret;
+
+		ret = spd5118_read_block(client, SPD5118_CLASS_BULK,
+					 SPD5118_EEPROM_BASE + (offset & (SPD5118_PAGE_SIZE - 1)),
+					 chunk, key);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+
+		key += ret;
+		offset += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * After resume or an offline period the module may have been swapped. A
+ * handful of key bytes is enough to tell; only then is the shadow dropped
+ * and the generation bumped.
+ */
+static void spd5118_revalidate_work_fn(struct work_struct *work)
+{
+	struct spd5118_data *data = container_of(work, struct spd5118_data,
+						 revalidate_work);
+	struct i2c_client *client = data->client;
+	u8 key[SPD_DDR5_KEY_LEN];
+	u32 hash, old;
+	bool known;
+
+	mutex_lock(&data->page_lock);
+
+	known = data->hash_valid;
+	old = data->eeprom_hash;
+
+	/* Without a hash yet, whatever the shadow holds is the baseline */
+	if (!known && spd5118_key_shadowed(data)) {
+		old = spd5118_key_hash(&data->eeprom[SPD_DDR5_KEY]);
+		known = true;
+	}
+
+	if (spd5118_read_key(client, key, true))
+		goto out;
+
+	hash = spd5118_key_hash(key);
+	if (known && hash != old) {
+		dev_info(&client->dev, "SPD contents changed, dropping cached copy\n");
+		data->eeprom_valid = 0;
+		data->spd_valid = false;
+		data->crc_checked = false;
+		data->eeprom_generation++;
+	}
+	data->eeprom_hash = hash;
+	data->hash_valid = true;
+out:
+	mutex_unlock(&data->page_lock);
+}
+
+static ssize_t
+eeprom_generation_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spd5118_data *data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(data->eeprom_generation));
+}
+
+static DEVICE_ATTR_RO(eeprom_generation);
+
+static ssize_t
+eeprom_hash_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u8 key[SPD_DDR5_KEY_LEN];
+	ssize_t ret = 0;
+
+	mutex_lock(&data->page_lock);
+	if (!data->hash_valid) {
+		ret = spd5118_read_key(client, key, false);
+		if (!ret) {
+			data->eeprom_hash = spd5118_key_hash(key);
+			data->hash_valid = true;
+		}
+	}
+	if (!ret)
+		ret = sprintf(buf, "%08x\n", data->eeprom_hash);
+	mutex_unlock(&data->page_lock);
+
+	return ret;
+}
+
+static DEVICE_ATTR_RO(eeprom_hash);
+
+/*
+ * Snapshot of MR0:MR127, taken in as few block reads as the adapter allows
+ * and under page_lock, so it cannot interleave with a page switch. The raw
+ * dump is followed by the registers the driver knows about.
+ */
+#define SPD5118_NUM_REGS		128
+
+static int spd5118_registers_show(struct seq_file *s, void *unused)
+{
+	struct spd5118_data *data = s->private;
+	struct i2c_client *client = data->client;
+	u8 regs[SPD5118_NUM_REGS];
+	int current_page;
+	int i, ret = 0;
+
+	mutex_lock(&data->page_lock);
+	for (i = 0; i < SPD5118_NUM_REGS; i += ret) {
+		ret = spd5118_read_block(client, SPD5118_CLASS_BULK, i,
+					 SPD5118_NUM_REGS - i, regs + i);
+		if (ret <= 0)
+			break;
+	}
+	current_page = data->current_page;
+	mutex_unlock(&data->page_lock);
+
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -EIO;
+
+	for (i = 0; i < SPD5118_NUM_REGS; i += 16)
+		seq_printf(s, "%02x: %16ph\n", i, &regs[i]);
+
+	seq_puts(s, "\n");
+	seq_printf(s, "MR0:1   device type       0x%04x\n",
+		   regs[SPD5118_REG_TYPE] << 8 | regs[SPD5118_REG_TYPE + 1]);
+	seq_printf(s, "MR2     revision          0x%02x\n",
+		   regs[SPD5118_REG_REVISION]);
+	seq_printf(s, "MR3:4   vendor            0x%04x\n",
+		   regs[SPD5118_REG_VENDOR] | regs[SPD5118_REG_VENDOR + 1] << 8);
+	seq_printf(s, "MR11    legacy mode       0x%02x (page %d, cached %d)\n",
+		   regs[SPD5118_REG_I2C_LEGACY_MODE],
+		   regs[SPD5118_REG_I2C_LEGACY_MODE] & (SPD5118_NUM_PAGES - 1),
+		   current_page);
+	seq_printf(s, "MR12:13 write protect     0x%04x\n",
+		   regs[SPD5118_REG_WRITE_PROTECT] |
+		   regs[SPD5118_REG_WRITE_PROTECT + 1] << 8);
+	seq_printf(s, "MR26    temp config       0x%02x%s\n",
+		   regs[SPD5118_REG_TEMP_CONFIG],
+		   regs[SPD5118_REG_TEMP_CONFIG] & SPD5118_TS_DISABLE ? " (disabled)" : "");
+	seq_printf(s, "MR28:29 high limit        %d\n",
+		   spd5118_temp_from_reg(regs[SPD5118_REG_TEMP_MAX] |
+					 regs[SPD5118_REG_TEMP_MAX + 1] << 8));
+	seq_printf(s, "MR30:31 low limit         %d\n",
+		   spd5118_temp_from_reg(regs[SPD5118_REG_TEMP_MIN] |
+					 regs[SPD5118_REG_TEMP_MIN + 1] << 8));
+	seq_printf(s, "MR32:33 critical high     %d\n",
+		   spd5118_temp_from_reg(regs[SPD5118_REG_TEMP_CRIT] |
+					 regs[SPD5118_REG_TEMP_CRIT + 1] << 8));
+	seq_printf(s, "MR34:35 critical low      %d\n",
+		   spd5118_temp_from_reg(regs[SPD5118_REG_TEMP_LCRIT] |
+					 regs[SPD5118_REG_TEMP_LCRIT + 1] << 8));
+	seq_printf(s, "MR48    device status     0x%02x%s\n",
+		   regs[SPD5118_REG_DEV_STATUS],
+		   regs[SPD5118_REG_DEV_STATUS] & SPD5118_STATUS_WRITE_BUSY ?
+		   " (write busy)" : "");
+	seq_printf(s, "MR49:50 temperature       %d\n",
+		   spd5118_temp_from_reg(regs[SPD5118_REG_TEMP] |
+					 regs[SPD5118_REG_TEMP + 1] << 8));
+	seq_printf(s, "MR51    temp status       0x%02x%s%s%s%s\n",
+		   regs[SPD5118_REG_TEMP_STATUS],
+		   regs[SPD5118_REG_TEMP_STATUS] & SPD5118_TEMP_STATUS_HIGH ? " high" : "",
+		   regs[SPD5118_REG_TEMP_STATUS] & SPD5118_TEMP_STATUS_LOW ? " low" : "",
+		   regs[SPD5118_REG_TEMP_STATUS] & SPD5118_TEMP_STATUS_CRIT ? " crit" : "",
+		   regs[SPD5118_REG_TEMP_STATUS] & SPD5118_TEMP_STATUS_LCRIT ? " lcrit" : "");
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(spd5118_registers);
+
+static struct attribute *spd5118_attrs[] = {
+	&dev_attr_revision.attr,
+	&dev_attr_pmic_vendor_id.attr,
+	&dev_attr_spd_manufacturer.attr,
+	&dev_attr_spd_dram_manufacturer.attr,
+	&dev_attr_spd_part_number.attr,
+	&dev_attr_spd_serial.attr,
+	&dev_attr_spd_manufacture_date.attr,
+	&dev_attr_spd_module_type.attr,
+	&dev_attr_spd_capacity_mb.attr,
+	&dev_attr_spd_ranks.attr,
+	&dev_attr_spd_tck_min_ps.attr,
+	&dev_attr_spd_speed.attr,
+	&dev_attr_spd_crc_valid.attr,
+	&dev_attr_spd_crc_stored.attr,
+	&dev_attr_spd_crc_computed.attr,
+	&dev_attr_eeprom_generation.attr,
+	&dev_attr_eeprom_hash.attr,
+	NULL,
+};
+
+static BIN_ATTR_RW(eeprom, SPD5118_EEPROM_SIZE);
+
+static struct bin_attribute *spd5118_bin_attrs[] = {
+	&bin_attr_eeprom,
+	NULL
+};
+
+static umode_t spd5118_bin_is_visible(struct kobject *kobj,
+				      struct bin_attribute *attr, int n)
+{
+	return enable_eeprom_write ? 0644 : 0444;
+}
+
+static const struct attribute_group spd5118_attr_group = {
+	.attrs = spd5118_attrs,
+	.bin_attrs = spd5118_bin_attrs,
+	.is_bin_visible = spd5118_bin_is_visible,
+};
+
+static const struct attribute_group *spd5118_groups[] = {
+	&spd5118_attr_group,
+	NULL,
+};
+
+/* Return 0 if detection is successful, -ENODEV otherwise */
+static int spd5118_detect(struct i2c_client *client, struct i2c_board_info *info)
+{
+	struct i2c_adapter *adapter = client->adapter;
+	int cap, vendor;
+
+	if (!i2c_check_functionality(adapter, I2C_FUNC_SMBUS_BYTE_DATA |
+				     I2C_FUNC_SMBUS_WORD_DATA))
+		return -ENODEV;
+
+	cap = i2c_smbus_read_word_swapped(client, SPD5118_REG_TYPE);
+	if (cap != 0x5118)
+		return -ENODEV;
+
+	vendor = i2c_smbus_read_word_data(client, SPD5118_REG_VENDOR);
+	if (vendor < 0 || !spd5118_vendor_valid(vendor))
+		return -ENODEV;
+
+	strscpy(info->type, "spd5118", I2C_NAME_SIZE);
+	return 0;
+}
+
+#define SPD5118_TEMP_CONFIG	(HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_FAULT | \
+				 HWMON_T_LCRIT | HWMON_T_LCRIT_ALARM | \
+				 HWMON_T_MIN | HWMON_T_MIN_ALARM | \
+				 HWMON_T_MAX | HWMON_T_MAX_ALARM | \
+				 HWMON_T_CRIT | HWMON_T_CRIT_ALARM)
+
+static const struct hwmon_channel_info *spd5118_info[] = {
+	HWMON_CHANNEL_INFO(chip,
+			   HWMON_C_REGISTER_TZ),
+	HWMON_CHANNEL_INFO(temp,
+			   SPD5118_TEMP_CONFIG,
+			   SPD5118_TEMP_CONFIG,
+			   SPD5118_TEMP_CONFIG),
+	HWMON_CHANNEL_INFO(in,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL),
+	HWMON_CHANNEL_INFO(curr,
+			   HWMON_C_INPUT | HWMON_C_LABEL,
+			   HWMON_C_INPUT | HWMON_C_LABEL,
+			   HWMON_C_INPUT | HWMON_C_LABEL,
+			   HWMON_C_INPUT | HWMON_C_LABEL),
+	HWMON_CHANNEL_INFO(power,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL),
+	NULL
+};
+
+static const struct hwmon_ops spd5118_hwmon_ops = {
+	.is_visible = spd5118_is_visible,
+	.read = spd5118_read,
+	.read_string = spd5118_read_string,
+	.write = spd5118_write,
+};
+
+static const struct hwmon_chip_info spd5118_chip_info = {
+	.ops = &spd5118_hwmon_ops,
+	.info = spd5118_info,
+};
+
+/*
+ * One more hwmon device sums up all bound hubs, so fan control needs a
+ * single read: temp1 is the hottest sensor and temp1_hottest names it by
+ * hub and label, temp2 is the mean over all sensors. It only exists with
+ * the background sampler, which builds the summary from the samples it
+ * just published; reads take that snapshot and never go to the bus.
+ */
+struct spd5118_summary {
+	int max;
+	int mean;
+	char hottest[32];		/* e.g. "0-0051 ts0" */
+	ktime_t timestamp;		/* end of the round, 0 if none */
+};
+
+static DEFINE_SPINLOCK(spd5118_summary_lock);	/* protect spd5118_summary */
+static struct spd5118_summary spd5118_summary;
+
+static DEFINE_MUTEX(spd5118_aggregate_lock);
+static unsigned int spd5118_aggregate_users;
+static struct platform_device *spd5118_aggregate_pdev;
+static struct device *spd5118_aggregate_hwmon;
+
+/* Called by the sampler with spd5118_devices_lock held, after its round */
+static void spd5118_summarize(void)
+{
+	struct spd5118_summary sum = { };
+	struct spd5118_sample sample;
+	struct spd5118_data *data;
+	unsigned int n = 0;
+	s64 total = 0;
+	int ch, temp;
+
+	list_for_each_entry(data, &spd5118_devices, node) {
+		/* A hub that stopped answering must not hold up max or mean */
+		spd5118_get_sample(data, &sample);
+		if (!sample.timestamp || sample.stale ||
+		    test_bit(SPD5118_OFFLINE, &data->flags) ||
+		    ktime_ms_delta(ktime_get(), sample.timestamp) >= spd5118_max_age_ms())
+			continue;
+
+		for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+			if (!data->channel[ch])
+				continue;
+
+			temp = spd5118_temp_from_reg(sample.temp[ch]);
+			if (!n || temp > sum.max) {
+				sum.max = temp;
+				snprintf(sum.hottest, sizeof(sum.hottest), "%s %s",
+					 dev_name(&data->client->dev),
+					 spd5118_channel_labels[ch]);
+			}
+			total += temp;
+			n++;
+		}
+	}
+
+	if (n) {
+		sum.mean = div_s64(total, n);
+		sum.timestamp = ktime_get();
+	}
+
+	spin_lock(&spd5118_summary_lock);
+	spd5118_summary = sum;
+	spin_unlock(&spd5118_summary_lock);
+}
+
+/* All values of one read come from the same round */
+static int spd5118_get_summary(struct spd5118_summary *sum)
+{
+	spin_lock(&spd5118_summary_lock);
+	*sum = spd5118_summary;
+	spin_unlock(&spd5118_summary_lock);
+
+	if (!sum->timestamp ||
+	    ktime_ms_delta(ktime_get(), sum->timestamp) >= spd5118_max_age_ms())
+		return -ENODATA;
+	return 0;
+}
+
+static int spd5118_aggregate_read(struct device *dev, enum hwmon_sensor_types type,
+				  u32 attr, int channel, long *val)
+{
+	struct spd5118_summary sum;
+	int ret;
+
+	if (type != hwmon_temp || attr != hwmon_temp_input)
+		return -EOPNOTSUPP;
+
+	ret = spd5118_get_summary(&sum);
+	if (ret)
+		return ret;
+
+	*val = channel ? sum.mean : sum.max;
+	return 0;
+}
+
+static const char * const spd5118_aggregate_labels[] = { "max", "mean" };
+
+static int spd5118_aggregate_read_string(struct device *dev,
+					 enum hwmon_sensor_types type, u32 attr,
+					 int channel, const char **str)
+{
+	if (type != hwmon_temp || attr != hwmon_temp_label)
+		return -EOPNOTSUPP;
+
+	*str = spd5118_aggregate_labels[channel];
+	return 0;
+}
+
+static umode_t spd5118_aggregate_is_visible(const void *data,
+					    enum hwmon_sensor_types type,
+					    u32 attr, int channel)
+{
+	return type == hwmon_temp ? 0444 : 0;
+}
+
+static const struct hwmon_channel_info *spd5118_aggregate_info[] = {
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL),
+	NULL
+};
+
+static const struct hwmon_ops spd5118_aggregate_ops = {
+	.is_visible = spd5118_aggregate_is_visible,
+	.read = spd5118_aggregate_read,
+	.read_string = spd5118_aggregate_read_string,
+};
+
+static const struct hwmon_chip_info spd5118_aggregate_chip_info = {
+	.ops = &spd5118_aggregate_ops,
+	.info = spd5118_aggregate_info,
+};
+
+static ssize_t
+temp1_hottest_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct spd5118_summary sum;
+	int ret;
+
+	ret = spd5118_get_summary(&sum);
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%s\n", sum.hottest);
+}
+
+static DEVICE_ATTR_RO(temp1_hottest);
+
+static struct attribute *spd5118_aggregate_attrs[] = {
+	&dev_attr_temp1_hottest.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(spd5118_aggregate);
+
+/*
+ * Registered with the first bound hub, removed with the last one. Without
+ * sample_interval_ms nothing would ever fill it in.
+ */
+static void spd5118_aggregate_get(void)
+{
+	struct platform_device *pdev;
+	struct device *hwmon_dev;
+
+	if (!sample_interval_ms)
+		return;
+
+	mutex_lock(&spd5118_aggregate_lock);
+	if (spd5118_aggregate_users++)
+		goto out;
+
+	pdev = platform_device_register_simple("spd5118-aggregate",
+					       PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(pdev)) {
+		pr_warn("Failed to register aggregate device (%ld)\n", PTR_ERR(pdev));
+		goto out;
+	}
+
+	hwmon_dev = hwmon_device_register_with_info(&pdev->dev, "spd5118_all", NULL,
+						    &spd5118_aggregate_chip_info,
+						    spd5118_aggregate_groups);
+	if (IS_ERR(hwmon_dev)) {
+		pr_warn("Failed to register aggregate sensor (%ld)\n",
+			PTR_ERR(hwmon_dev));
+		platform_device_unregister(pdev);
+		goto out;
+	}
+
+	spd5118_aggregate_pdev = pdev;
+	spd5118_aggregate_hwmon = hwmon_dev;
+out:
+	mutex_unlock(&spd5118_aggregate_lock);
+}
+
+static void spd5118_aggregate_put(void)
+{
+	if (!sample_interval_ms)
+		return;
+
+	mutex_lock(&spd5118_aggregate_lock);
+	if (!--spd5118_aggregate_users && spd5118_aggregate_pdev) {
+		hwmon_device_unregister(spd5118_aggregate_hwmon);
+		platform_device_unregister(spd5118_aggregate_pdev);
+		spd5118_aggregate_hwmon = NULL;
+		spd5118_aggregate_pdev = NULL;
+	}
+	mutex_unlock(&spd5118_aggregate_lock);
+}
 
-static struct bin_attribute *spd5118_bin_attrs[] = {
-	&bin_attr_eeprom,
-	NULL
-};
+static int spd5118_window_stats_show(struct seq_file *s, void *unused)
+{
+	struct spd5118_data *data = s->private;
+	s64 bytes = atomic64_read(&data->window_bytes);
+	s64 baseline = atomic64_read(&data->window_baseline);
+
+	seq_printf(s, "quiet %d\n", atomic_read(&data->window_quiet));
+	seq_printf(s, "trips %d\n", atomic_read(&data->window_trips));
+	seq_printf(s, "bytes %lld\n", bytes);
+	seq_printf(s, "baseline_bytes %lld\n", baseline);
+	seq_printf(s, "saved_bytes %lld\n", baseline - bytes);
+	return 0;
+}
 
-static const struct attribute_group spd5118_attr_group = {
-	.attrs = spd5118_attrs,
-	.bin_attrs = spd5118_bin_attrs,
-};
+DEFINE_SHOW_ATTRIBUTE(spd5118_window_stats);
 
-static const struct attribute_group *spd5118_groups[] = {
-	&spd5118_attr_group,
-	NULL,
-};
+static void spd5118_reprobe_work_fn(struct work_struct *work);
+static void spd5118_window_stop(struct spd5118_data *data);
 
-/* Return 0 if detection is successful, -ENODEV otherwise */
-static int spd5118_detect(struct i2c_client *client, struct i2c_board_info *info)
+static void spd5118_bus_release(void *bus)
 {
-	struct i2c_adapter *adapter = client->adapter;
-	int cap, vendor;
-
-	if (!i2c_check_functionality(adapter, I2C_FUNC_SMBUS_BYTE_DATA |
-				     I2C_FUNC_SMBUS_WORD_DATA))
-		return -ENODEV;
+	spd5118_bus_put(bus);
+}
 
-	cap = i2c_smbus_read_word_swapped(client, SPD5118_REG_TYPE);
-	if (cap != 0x5118)
-		return -ENODEV;
+static void spd5118_cancel_work(void *_data)
+{
+	struct spd5118_data *data = _data;
 
-	vendor = i2c_smbus_read_word_data(client, SPD5118_REG_VENDOR);
-	if (vendor < 0 || !spd5118_vendor_valid(vendor))
-		return -ENODEV;
+	cancel_delayed_work_sync(&data->reprobe_work);
+	cancel_work_sync(&data->revalidate_work);
+}
 
-	strscpy(info->type, "spd5118", I2C_NAME_SIZE);
-	return 0;
+static void spd5118_debugfs_release(void *dentry)
+{
+	debugfs_remove_recursive(dentry);
 }
 
-static const struct hwmon_channel_info *spd5118_info[] = {
-	HWMON_CHANNEL_INFO(chip,
-			   HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp,
-			   HWMON_T_INPUT |
-			   HWMON_T_LCRIT | HWMON_T_LCRIT_ALARM |
-			   HWMON_T_MIN | HWMON_T_MIN_ALARM |
-			   HWMON_T_MAX | HWMON_T_MAX_ALARM |
-			   HWMON_T_CRIT | HWMON_T_CRIT_ALARM),
-	NULL
-};
+/*
+ * Look for the TS0/TS1 sensors of an RDIMM. Their transfers are accounted
+ * to the hub, so they share its retry policy, bus budget and offline state.
+ * A sensor that cannot be bound only costs its channel.
+ */
+static void spd5118_probe_ts(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	static const u8 lid[] = { 0x10, 0x30 };
+	union i2c_smbus_data smbus;
+	struct i2c_client *ts;
+	u16 addr;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lid); i++) {
+		addr = lid[i] | (client->addr & SPD5118_HID_MASK);
+		if (i2c_smbus_xfer(client->adapter, addr, 0, I2C_SMBUS_READ,
+				   SPD5118_REG_TYPE, I2C_SMBUS_WORD_DATA, &smbus) < 0 ||
+		    swab16(smbus.word) != SPD5118_TS_TYPE)
+			continue;
+
+		ts = devm_i2c_new_dummy_device(&client->dev, client->adapter, addr);
+		if (IS_ERR(ts)) {
+			dev_warn(&client->dev, "TS%d at 0x%02x not usable (%ld)\n",
+				 i, addr, PTR_ERR(ts));
+			continue;
+		}
+
+		i2c_set_clientdata(ts, data);
+		data->channel[i + 1] = ts;
+		dev_dbg(&client->dev, "TS%d at 0x%02x\n", i, addr);
+	}
+}
 
-static const struct hwmon_ops spd5118_hwmon_ops = {
-	.is_visible = spd5118_is_visible,
-	.read = spd5118_read,
-	.write = spd5118_write,
-};
+/*
+ * With pmic_telemetry, bind the module's PMIC and set it up for
+ * spd5118_pmic_refill(): R0C:R0F in current mode, the ADC on rail SWA.
+ * Nothing is written before the device has a valid JEP106 vendor ID in
+ * R3C:R3D and the reserved bits of R0C:R0F read as zero, as something
+ * else may sit at that address. A PMIC that is missing or refuses the
+ * setup only costs the telemetry.
+ */
+static void spd5118_probe_pmic(struct i2c_client *client)
+{
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u16 addr = SPD5118_PMIC_LID | (client->addr & SPD5118_HID_MASK);
+	u8 curr[SPD5118_PMIC_RAILS];
+	union i2c_smbus_data smbus;
+	struct i2c_client *pmic;
+	int i, ret;
+
+	if (!pmic_telemetry)
+		return;
+
+	if (i2c_smbus_xfer(client->adapter, addr, 0, I2C_SMBUS_READ,
+			   SPD5118_PMIC_REG_VENDOR, I2C_SMBUS_WORD_DATA, &smbus) < 0 ||
+	    !spd5118_vendor_valid(smbus.word))
+		return;
+
+	pmic = devm_i2c_new_dummy_device(&client->dev, client->adapter, addr);
+	if (IS_ERR(pmic))
+		return;
+	i2c_set_clientdata(pmic, data);
+
+	ret = spd5118_read_block(pmic, SPD5118_CLASS_THERMAL, SPD5118_PMIC_REG_CURRENT,
+				 sizeof(curr), curr);
+	if (ret >= 0 && ret < sizeof(curr))
+		ret = -EIO;
+	for (i = 0; ret >= 0 && i < SPD5118_PMIC_RAILS; i++) {
+		if (curr[i] & ~SPD5118_PMIC_CURRENT_MASK)
+			ret = -ENODEV;
+	}
+	if (ret >= 0)
+		ret = spd5118_read_byte(pmic, SPD5118_PMIC_REG_METER);
+	if (ret >= 0 && (ret & SPD5118_PMIC_METER_POWER))
+		ret = spd5118_write_byte(pmic, SPD5118_PMIC_REG_METER,
+					 ret & ~SPD5118_PMIC_METER_POWER);
+	if (ret >= 0)
+		ret = spd5118_write_byte(pmic, SPD5118_PMIC_REG_ADC_CTRL,
+					 SPD5118_PMIC_ADC_ENABLE |
+					 FIELD_PREP(SPD5118_PMIC_ADC_SELECT, 0));
+	if (ret < 0) {
+		dev_warn(&client->dev, "PMIC at 0x%02x not usable (%d)\n", addr, ret);
+		return;
+	}
 
-static const struct hwmon_chip_info spd5118_chip_info = {
-	.ops = &spd5118_hwmon_ops,
-	.info = spd5118_info,
-};
+	data->pmic = pmic;
+}
 
 static int spd5118_probe(struct i2c_client *client)
 {
@@ -484,6 +2900,7 @@ static int spd5118_probe(struct i2c_client *client)
 	struct device *hwmon_dev;
 	unsigned int typ, revision, vendor;
 	struct spd5118_data *data;
+	int ch, i, limit, ret;
 
 	typ = i2c_smbus_read_word_swapped(client, SPD5118_REG_TYPE);
 	if (typ != 0x5118) {
@@ -505,19 +2922,487 @@ static int spd5118_probe(struct i2c_client *client)
 
 	i2c_set_clientdata(client, data);
 
-	mutex_init(&data->update_lock);
+	data->client = client;
+	data->bus = spd5118_bus_get(client->adapter);
+	if (!data->bus)
+		return -ENOMEM;
+	ret = devm_add_action_or_reset(dev, spd5118_bus_release, data->bus);
+	if (ret)
+		return ret;
+
+	mutex_init(&data->page_lock);
+	mutex_init(&data->limits_lock);
+	mutex_init(&data->sample_lock);
+	seqcount_mutex_init(&data->sample_seq, &data->sample_lock);
+	spin_lock_init(&data->flight_lock);
+	init_completion(&data->flight_done);
+	init_waitqueue_head(&data->bulk_wq);
+	INIT_DELAYED_WORK(&data->reprobe_work, spd5118_reprobe_work_fn);
+	INIT_WORK(&data->revalidate_work, spd5118_revalidate_work_fn);
+	ret = devm_add_action_or_reset(dev, spd5118_cancel_work, data);
+	if (ret)
+		return ret;
+
 	data->current_page = -1;
 	data->vendor = vendor;
 	data->revision = revision;
 
+	data->channel[0] = client;
+	spd5118_probe_ts(client);
+	spd5118_probe_pmic(client);
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+		if (!data->channel[ch])
+			continue;
+
+		for (i = 0; i < SPD5118_NUM_LIMITS; i++) {
+			limit = spd5118_read_word(data->channel[ch],
+						  SPD5118_REG_TEMP_MAX + 2 * i);
+			if (limit < 0)
+				return limit;
+			data->sample.limits[ch][i] = limit;
+		}
+	}
+
+	data->debugfs = debugfs_create_dir(dev_name(dev), spd5118_debugfs);
+	debugfs_create_atomic_t("xfer_transient", 0444, data->debugfs,
+				&data->xfer_transient);
+	debugfs_create_atomic_t("xfer_fatal", 0444, data->debugfs,
+				&data->xfer_fatal);
+	debugfs_create_atomic_t("xfer_retried", 0444, data->debugfs,
+				&data->xfer_retried);
+	debugfs_create_atomic_t("stale_reads", 0444, data->debugfs,
+				&data->stale_reads);
+	debugfs_create_atomic_t("coalesced", 0444, data->debugfs,
+				&data->coalesced);
+	debugfs_create_file("sched", 0444, data->debugfs, data,
+			    &spd5118_sched_stats_fops);
+	debugfs_create_file("registers", 0400, data->debugfs, data,
+			    &spd5118_registers_fops);
+	debugfs_create_file("alarm_log", 0444, data->debugfs, data,
+			    &spd5118_events_fops);
+	if (window_mc)
+		debugfs_create_file("window", 0444, data->debugfs, data,
+				    &spd5118_window_stats_fops);
+	ret = devm_add_action_or_reset(dev, spd5118_debugfs_release, data->debugfs);
+	if (ret)
+		return ret;
+
+	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, ts_autosuspend_ms);
+	pm_runtime_use_autosuspend(dev);
+	ret = devm_pm_runtime_enable(dev);
+	if (ret)
+		return ret;
+
 	hwmon_dev = devm_hwmon_device_register_with_info(dev, "spd5118",
 							 client, &spd5118_chip_info,
-							 NULL);
-	return PTR_ERR_OR_ZERO(hwmon_dev);
+							 spd5118_hwmon_groups);
+	if (IS_ERR(hwmon_dev))
+		return PTR_ERR(hwmon_dev);
+
+	mutex_lock(&spd5118_devices_lock);
+	list_add_tail(&data->node, &spd5118_devices);
+	mutex_unlock(&spd5118_devices_lock);
+
+	spd5118_aggregate_get();
+
+	return 0;
 }
 
 static void spd5118_remove(struct i2c_client *client)
 {
+	struct spd5118_data *data = i2c_get_clientdata(client);
+
+	mutex_lock(&spd5118_devices_lock);
+	list_del(&data->node);
+	mutex_unlock(&spd5118_devices_lock);
+
+	spd5118_aggregate_put();
+
+	spd5118_window_stop(data);
+
+	/* Leave the thermal sensor running for whoever binds next */
+	pm_runtime_get_sync(&client->dev);
+	pm_runtime_put_noidle(&client->dev);
+}
+
+/* Switch every sensor on the module on or off in MR26 */
+static int spd5118_set_ts_disable(struct spd5118_data *data, bool disable)
+{
+	struct i2c_client *client;
+	int ch, regval, ret;
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+		client = data->channel[ch];
+		if (!client)
+			continue;
+
+		regval = spd5118_read_byte(client, SPD5118_REG_TEMP_CONFIG);
+		if (regval < 0)
+			return regval;
+
+		if (disable)
+			regval |= SPD5118_TS_DISABLE;
+		else
+			regval &= ~SPD5118_TS_DISABLE;
+
+		ret = spd5118_write_byte(client, SPD5118_REG_TEMP_CONFIG, regval);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Any error but -EAGAIN or -EBUSY sticks in power.runtime_error and fails
+ * every later pm_runtime_resume_and_get() until rebind, so report a
+ * failed transfer as worth retrying.
+ */
+static int spd5118_runtime_suspend(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+
+	/* An offline hub gets its sensor state back from spd5118_restore() */
+	if (test_bit(SPD5118_OFFLINE, &data->flags))
+		return 0;
+
+	return spd5118_set_ts_disable(data, true) ? -EAGAIN : 0;
+}
+
+static int spd5118_runtime_resume(struct device *dev)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	int ret;
+
+	if (test_bit(SPD5118_OFFLINE, &data->flags))
+		return 0;
+
+	ret = spd5118_set_ts_disable(data, false);
+	if (ret)
+		return -EAGAIN;
+
+	data->ts_ready = ktime_add_us(ktime_get(), SPD5118_TEMP_CONV_US);
+	return 0;
+}
+
+/* Bring a hub that may have lost power back to the state we left it in */
+static int spd5118_restore(struct i2c_client *client)
+{
+	struct device *dev = &client->dev;
+	struct spd5118_data *data = i2c_get_clientdata(client);
+	u16 hw[SPD5118_NUM_LIMITS];
+	int ch, ret = 0;
+
+	/* The hub may have been powered down, so MR11 is back to its default */
+	mutex_lock(&data->page_lock);
+	data->current_page = -1;
+	mutex_unlock(&data->page_lock);
+
+	/* Someone may have swapped the module while it was unpowered */
+	queue_work(system_freezable_wq, &data->revalidate_work);
+
+	mutex_lock(&data->limits_lock);
+	for (ch = 0; data->limits_dirty && ch < SPD5118_NUM_CHANNELS && !ret; ch++) {
+		if (!data->channel[ch])
+			continue;
+
+		spd5118_hw_limits(data, ch, data->sample.limits[ch], hw);
+		ret = spd5118_write_limits(data->channel[ch], hw);
+		if (ret < 0)
+			dev_err(dev, "Failed to restore limits of %s (%d)\n",
+				spd5118_channel_labels[ch], ret);
+	}
+	mutex_unlock(&data->limits_lock);
+
+	/* A power cycle re-enables the sensor behind runtime PM's back */
+	if (!ret)
+		ret = spd5118_set_ts_disable(data, pm_runtime_status_suspended(dev));
+	if (!ret)
+		data->ts_ready = ktime_add_us(ktime_get(), SPD5118_TEMP_CONV_US);
+
+	return ret;
+}
+
+static int spd5118_resume(struct device *dev)
+{
+	return spd5118_restore(to_i2c_client(dev));
+}
+
+static void spd5118_reprobe_work_fn(struct work_struct *work)
+{
+	struct spd5118_data *data = container_of(to_delayed_work(work),
+						 struct spd5118_data,
+						 reprobe_work);
+	struct i2c_client *client = data->client;
+	int typ;
+
+	/* Bypass spd5118_xfer(), which refuses to talk to offline hubs */
+	typ = i2c_smbus_read_word_swapped(client, SPD5118_REG_TYPE);
+	if (typ != 0x5118) {
+		data->reprobe_ms = min_t(unsigned int, 2 * data->reprobe_ms,
+					 SPD5118_REPROBE_MAX_MS);
+		queue_delayed_work(system_freezable_wq, &data->reprobe_work,
+				   msecs_to_jiffies(data->reprobe_ms));
+		return;
+	}
+
+	dev_info(&client->dev, "Hub is responding again\n");
+	atomic_set(&data->failures, 0);
+	clear_bit(SPD5118_OFFLINE, &data->flags);
+	spd5118_restore(client);
+}
+
+/*
+ * The sampler runs on the freezable workqueue, so it is paused before the
+ * hubs are suspended and only resumes after they have been restored.
+ */
+static void spd5118_sample_work_fn(struct work_struct *work);
+
+static DECLARE_DELAYED_WORK(spd5118_sample_work, spd5118_sample_work_fn);
+
+static struct sk_buff *spd5118_genl_batch_new(void **hdr)
+{
+	struct sk_buff *skb;
+
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	*hdr = genlmsg_put(skb, 0, 0, &spd5118_genl_family, 0, SPD5118_CMD_SAMPLES);
+	if (!*hdr) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+static void spd5118_genl_batch_send(struct sk_buff *skb, void *hdr)
+{
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&spd5118_genl_family, skb, 0, SPD5118_MCGRP_SAMPLES,
+			  GFP_KERNEL);
+}
+
+/* Add one sensor to the round's message, starting a new one when it is full */
+static struct sk_buff *spd5118_genl_batch_add(struct sk_buff *skb, void **hdr,
+					      struct spd5118_data *data,
+					      const struct spd5118_sample *sample,
+					      int channel)
+{
+	struct nlattr *nest;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		nest = nla_nest_start(skb, SPD5118_A_SAMPLE);
+		if (nest && !spd5118_genl_put_sample(skb, data, sample, channel)) {
+			nla_nest_end(skb, nest);
+			return skb;
+		}
+		if (nest)
+			nla_nest_cancel(skb, nest);
+
+		spd5118_genl_batch_send(skb, *hdr);
+		skb = spd5118_genl_batch_new(hdr);
+		if (!skb)
+			return NULL;
+	}
+	return skb;
+}
+
+/*
+ * Window mode: MR28:MR31 of every sensor hold a window of +/- window_mc
+ * around its last reading, so a round only needs MR51. As long as no
+ * sensor left its window or changed its critical alarms, the published
+ * temperatures are still good to within window_mc and only get a new
+ * timestamp; otherwise the module is read in full and the windows are
+ * moved to the new readings.
+ */
+static int spd5118_window_poll(struct spd5118_data *data)
+{
+	const u8 crit = SPD5118_TEMP_STATUS_CRIT | SPD5118_TEMP_STATUS_LCRIT;
+	struct i2c_client *client = data->client;
+	struct spd5118_sample sample;
+	int ch, n = 0, ret;
+
+	spd5118_get_sample(data, &sample);
+	if (!READ_ONCE(data->window_active) || !sample.timestamp || sample.stale)
+		return 1;
+
+	ret = spd5118_ts_get(client);
+	if (ret < 0)
+		return ret;
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS && !ret; ch++) {
+		if (!data->channel[ch])
+			continue;
+
+		ret = spd5118_read_byte(data->channel[ch], SPD5118_REG_TEMP_STATUS);
+		if (ret < 0)
+			break;
+		n++;
+
+		ret = (ret & (SPD5118_TEMP_STATUS_HIGH | SPD5118_TEMP_STATUS_LOW)) ||
+		      (ret & crit) != (sample.status[ch] & crit);
+	}
+
+	spd5118_ts_put(client);
+
+	atomic64_add(n, &data->window_bytes);
+	if (ret)
+		return ret;
+
+	mutex_lock(&data->sample_lock);
+	write_seqcount_begin(&data->sample_seq);
+	data->sample.timestamp = ktime_get();
+	write_seqcount_end(&data->sample_seq);
+	mutex_unlock(&data->sample_lock);
+
+	atomic_inc(&data->window_quiet);
+	atomic64_add(3 * n, &data->window_baseline);
+	return 0;
+}
+
+static int spd5118_window_tick(struct spd5118_data *data)
+{
+	int ch, n = 0, ret;
+
+	ret = spd5118_window_poll(data);
+	if (ret <= 0)
+		return ret;
+
+	ret = spd5118_refill(data->client);
+	if (ret < 0)
+		return ret;
+
+	for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++)
+		n += !!data->channel[ch];
+	atomic64_add(3 * n, &data->window_bytes);
+	atomic64_add(3 * n, &data->window_baseline);
+	atomic_inc(&data->window_trips);
+
+	return spd5118_window_centre(data);
+}
+
+/* Give the user's high and low limits back to the hub */
+static void spd5118_window_stop(struct spd5118_data *data)
+{
+	int ch, ret;
+
+	mutex_lock(&data->limits_lock);
+	if (data->window_active) {
+		data->window_active = false;
+		for (ch = 0; ch < SPD5118_NUM_CHANNELS; ch++) {
+			if (!data->channel[ch])
+				continue;
+
+			ret = spd5118_write_limits(data->channel[ch],
+						   data->sample.limits[ch]);
+			if (ret < 0)
+				dev_warn(&data->client->dev,
+					 "Failed to restore limits of %s (%d)\n",
+					 spd5118_channel_labels[ch], ret);
+		}
+	}
+	mutex_unlock(&data->limits_lock);
+}
+
+static void spd5118_sample_work_fn(struct work_struct *work)
+{
+	struct spd5118_sample sample;
+	struct spd5118_data *data;
+	struct sk_buff *skb = NULL;
+	void *hdr;
+	int ch, ret;
+
+	/* One bus read per hub, fanned out to every subscriber */
+	if (spd5118_genl_listening(SPD5118_MCGRP_SAMPLES))
+		skb = spd5118_genl_batch_new(&hdr);
+
+	mutex_lock(&spd5118_devices_lock);
+	list_for_each_entry(data, &spd5118_devices, node) {
+		ret = window_mc ? spd5118_window_tick(data) : spd5118_refill(data->client);
+		if (ret < 0 || !skb)
+			continue;
+
+		spd5118_get_sample(data, &sample);
+		for (ch = 0; ch < SPD5118_NUM_CHANNELS && skb; ch++) {
+			if (data->channel[ch])
+				skb = spd5118_genl_batch_add(skb, &hdr, data,
+							     &sample, ch);
+		}
+	}
+	spd5118_summarize();
+	mutex_unlock(&spd5118_devices_lock);
+
+	if (skb)
+		spd5118_genl_batch_send(skb, hdr);
+
+	queue_delayed_work(system_freezable_wq, &spd5118_sample_work,
+			   msecs_to_jiffies(sample_interval_ms));
+}
+
+static const struct dev_pm_ops spd5118_pm_ops = {
+	SYSTEM_SLEEP_PM_OPS(NULL, spd5118_resume)
+	RUNTIME_PM_OPS(spd5118_runtime_suspend, spd5118_runtime_resume, NULL)
+};
+
+static int spd5118_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, spd5118_ring, vma->vm_pgoff);
+}
+
+static const struct file_operations spd5118_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.mmap		= spd5118_ring_mmap,
+};
+
+static struct miscdevice spd5118_misc = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "spd5118",
+	.fops		= &spd5118_ring_fops,
+	.mode		= 0444,
+};
+
+static bool spd5118_misc_registered;
+
+/* The ring is a nice to have, so carry on without it if this fails */
+static void spd5118_ring_init(void)
+{
+	int err;
+
+	spd5118_ring = vmalloc_user(PAGE_ALIGN(sizeof(*spd5118_ring)));
+	if (!spd5118_ring) {
+		pr_warn("Failed to allocate sample ring\n");
+		return;
+	}
+
+	spd5118_ring->hdr.magic = SPD5118_RING_MAGIC;
+	spd5118_ring->hdr.version = SPD5118_RING_VERSION;
+	spd5118_ring->hdr.entries = SPD5118_RING_ENTRIES;
+	spd5118_ring->hdr.entry_size = sizeof(struct spd5118_ring_entry);
+
+	err = misc_register(&spd5118_misc);
+	if (err) {
+		pr_warn("Failed to register /dev/spd5118 (%d)\n", err);
+		return;
+	}
+	spd5118_misc_registered = true;
+}
+
+static void spd5118_ring_exit(void)
+{
+	if (spd5118_misc_registered)
+		misc_deregister(&spd5118_misc);
+	/* Pages still mapped by userspace hold their own references */
+	vfree(spd5118_ring);
 }
 
 static const struct i2c_device_id spd5118_id[] = {
@@ -535,20 +3420,161 @@ MODULE_DEVICE_TABLE(of, spd5118_of_ids);
 #endif
 
 static struct i2c_driver spd5118_driver = {
-	.class		= I2C_CLASS_HWMON,
 	.driver = {
 		.name	= "spd5118",
 		.dev_groups = spd5118_groups,
 		.of_match_table = of_match_ptr(spd5118_of_ids),
+		.pm = pm_ptr(&spd5118_pm_ops),
 	},
 	.probe		= spd5118_probe,
 	.remove		= spd5118_remove,
 	.id_table	= spd5118_id,
+};
+
+/*
+ * Detection lives in a separate driver without an id_table, so it never binds
+ * anything itself. Registering it from a work item lets the i2c core probe the
+ * address list in the background instead of during module load, and the
+ * clients it instantiates are still torn down by the core on removal.
+ */
+static struct i2c_driver spd5118_scan_driver = {
+	.class		= I2C_CLASS_HWMON,
+	.driver = {
+		.name	= "spd5118-scan",
+	},
 	.detect		= spd5118_detect,
 	.address_list	= normal_i2c,
 };
 
-module_i2c_driver(spd5118_driver);
+static bool spd5118_scan_registered;
+
+static void spd5118_scan_work_fn(struct work_struct *work)
+{
+	int err;
+
+	err = i2c_add_driver(&spd5118_scan_driver);
+	if (err) {
+		pr_warn("Background scan failed (%d)\n", err);
+		return;
+	}
+	spd5118_scan_registered = true;
+}
+
+static DECLARE_WORK(spd5118_scan_work, spd5118_scan_work_fn);
+
+static struct i2c_client *spd5118_hint_clients[SPD5118_MAX_HINTS];
+
+/* Forget hinted clients whose adapter went away underneath us */
+static int spd5118_bus_notify(struct notifier_block *nb, unsigned long action,
+			      void *data)
+{
+	struct device *dev = data;
+	int i;
+
+	if (action != BUS_NOTIFY_DEL_DEVICE)
+		return NOTIFY_DONE;
+
+	for (i = 0; i < SPD5118_MAX_HINTS; i++) {
+		if (spd5118_hint_clients[i] && &spd5118_hint_clients[i]->dev == dev)
+			spd5118_hint_clients[i] = NULL;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block spd5118_bus_nb = {
+	.notifier_call = spd5118_bus_notify,
+};
+
+static void spd5118_instantiate_hints(void)
+{
+	struct i2c_board_info info = { I2C_BOARD_INFO("spd5118", 0) };
+	struct i2c_adapter *adapter;
+	struct i2c_client *client;
+	unsigned int bus, addr;
+	char sep;
+	int i;
+
+	/* bus:address, or the bus-address of a client's name in sysfs */
+	for (i = 0; i < num_probe_addrs; i++) {
+		if (sscanf(probe_addrs[i], "%u%c%x", &bus, &sep, &addr) != 3 ||
+		    (sep != ':' && sep != '-') || addr > 0x7f) {
+			pr_warn("Ignoring malformed hint '%s'\n", probe_addrs[i]);
+			continue;
+		}
+
+		adapter = i2c_get_adapter(bus);
+		if (!adapter) {
+			pr_warn("No adapter for hint '%s'\n", probe_addrs[i]);
+			continue;
+		}
+
+		info.addr = addr;
+		client = i2c_new_client_device(adapter, &info);
+		i2c_put_adapter(adapter);
+		if (IS_ERR(client)) {
+			pr_warn("Failed to instantiate hint '%s' (%ld)\n",
+				probe_addrs[i], PTR_ERR(client));
+			continue;
+		}
+		spd5118_hint_clients[i] = client;
+	}
+}
+
+static int __init spd5118_init(void)
+{
+	int err;
+
+	spd5118_debugfs = debugfs_create_dir("spd5118", NULL);
+	spd5118_ring_init();
+
+	err = genl_register_family(&spd5118_genl_family);
+	if (err)
+		pr_warn("Failed to register generic netlink family (%d)\n", err);
+	else
+		spd5118_genl_registered = true;
+
+	err = i2c_add_driver(&spd5118_driver);
+	if (err) {
+		if (spd5118_genl_registered)
+			genl_unregister_family(&spd5118_genl_family);
+		spd5118_ring_exit();
+		debugfs_remove_recursive(spd5118_debugfs);
+		return err;
+	}
+
+	bus_register_notifier(&i2c_bus_type, &spd5118_bus_nb);
+	spd5118_instantiate_hints();
+
+	if (scan)
+		schedule_work(&spd5118_scan_work);
+
+	if (sample_interval_ms)
+		queue_delayed_work(system_freezable_wq, &spd5118_sample_work, 0);
+
+	return 0;
+}
+module_init(spd5118_init);
+
+static void __exit spd5118_exit(void)
+{
+	int i;
+
+	cancel_delayed_work_sync(&spd5118_sample_work);
+	cancel_work_sync(&spd5118_scan_work);
+	if (spd5118_scan_registered)
+		i2c_del_driver(&spd5118_scan_driver);
+
+	bus_unregister_notifier(&i2c_bus_type, &spd5118_bus_nb);
+	for (i = 0; i < SPD5118_MAX_HINTS; i++)
+		i2c_unregister_device(spd5118_hint_clients[i]);
+
+	i2c_del_driver(&spd5118_driver);
+	if (spd5118_genl_registered)
+		genl_unregister_family(&spd5118_genl_family);
+	spd5118_ring_exit();
+	debugfs_remove_recursive(spd5118_debugfs);
+}
+module_exit(spd5118_exit);
 
 MODULE_AUTHOR("René Rebe <rene@exactcode.de>");
 MODULE_DESCRIPTION("SPD 5118 driver");
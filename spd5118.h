@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * spd5118.h - userspace interface of the spd5118 driver
+ *
+ * Every temperature sample the driver takes, from any sensor, is appended to a
+ * ring that userspace can map read-only from /dev/spd5118:
+ *
+ *	int fd = open("/dev/spd5118", O_RDONLY);
+ *	const struct spd5118_ring *ring = mmap(NULL, sizeof(*ring), PROT_READ,
+ *					       MAP_SHARED, fd, 0);
+ *	__u32 pos = spd5118_ring_head(ring);
+ *
+ *	for (;;) {
+ *		struct spd5118_ring_entry e;
+ *
+ *		while (pos == spd5118_ring_head(ring))
+ *			usleep(100000);
+ *		if (!spd5118_ring_read(ring, pos++, &e))
+ *			printf("%d-%04x %d\n", e.adapter, e.addr, e.temp);
+ *	}
+ *
+ * The helpers below are all a consumer needs; no syscalls are involved after
+ * the mmap.
+ */
+
+#ifndef _SPD5118_H
+#define _SPD5118_H
+
+#include <linux/types.h>
+
+#define SPD5118_RING_MAGIC		0x53504452	/* "SPDR" */
+#define SPD5118_RING_VERSION		1
+#define SPD5118_RING_ENTRIES		1024		/* power of two */
+
+/* spd5118_ring_entry.flags */
+#define SPD5118_SAMPLE_STALE		(1 << 0)	/* refill failed, older value */
+
+struct spd5118_ring_entry {
+	__u32 seq;		/* odd while the producer is writing the entry */
+	__u32 pos;		/* position in the stream, see spd5118_ring_read() */
+	__u16 adapter;		/* i2c adapter number */
+	__u8 addr;		/* 7 bit hub or TS0/TS1 address */
+	__u8 status;		/* MR51 */
+	__s32 temp;		/* millicelsius */
+	__u32 flags;
+	__u32 reserved;
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC */
+};
+
+struct spd5118_ring_header {
+	__u32 magic;
+	__u32 version;
+	__u32 entries;
+	__u32 entry_size;
+	__u32 head;		/* number of entries produced, wraps */
+	__u32 reserved[11];
+};
+
+struct spd5118_ring {
+	struct spd5118_ring_header hdr;
+	struct spd5118_ring_entry entry[SPD5118_RING_ENTRIES];
+};
+
+/*
+ * Generic netlink family. Every background sampling round (see the
+ * sample_interval_ms module parameter) is multicast to the "samples" group
+ * as one SPD5118_CMD_SAMPLES message with an SPD5118_A_SAMPLE nest per sensor,
+ * and every change of a sensor's MR51 status bits is multicast to the "alarms"
+ * group as an SPD5118_CMD_ALARM message.
+ */
+#define SPD5118_GENL_NAME		"spd5118"
+#define SPD5118_GENL_VERSION		1
+#define SPD5118_GENL_MCGRP_SAMPLES	"samples"
+#define SPD5118_GENL_MCGRP_ALARMS	"alarms"
+
+enum spd5118_genl_cmd {
+	SPD5118_CMD_UNSPEC,
+	SPD5118_CMD_SAMPLES,
+	SPD5118_CMD_ALARM,
+
+	__SPD5118_CMD_MAX,
+	SPD5118_CMD_MAX = __SPD5118_CMD_MAX - 1
+};
+
+enum spd5118_genl_attr {
+	SPD5118_A_UNSPEC,
+	SPD5118_A_SAMPLE,		/* nest */
+	SPD5118_A_ADAPTER,		/* u32, i2c adapter number */
+	SPD5118_A_ADDR,			/* u8, 7 bit hub or TS0/TS1 address */
+	SPD5118_A_TEMP,			/* s32, millicelsius */
+	SPD5118_A_STATUS,		/* u8, MR51 */
+	SPD5118_A_OLD_STATUS,		/* u8, MR51 before the transition */
+	SPD5118_A_TIMESTAMP,		/* u64, CLOCK_MONOTONIC ns */
+	SPD5118_A_STALE,		/* flag, refill failed, older value */
+	SPD5118_A_PAD,
+
+	__SPD5118_A_MAX,
+	SPD5118_A_MAX = __SPD5118_A_MAX - 1
+};
+
+#ifndef __KERNEL__
+
+/* Position the next entry will be written to */
+static inline __u32 spd5118_ring_head(const struct spd5118_ring *ring)
+{
+	return __atomic_load_n(&ring->hdr.head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copy out the entry at @pos. Returns 0 on success, or -1 if the producer
+ * has already overwritten it (the consumer fell more than
+ * SPD5118_RING_ENTRIES behind) or is writing it right now.
+ */
+static inline int spd5118_ring_read(const struct spd5118_ring *ring, __u32 pos,
+				    struct spd5118_ring_entry *out)
+{
+	const struct spd5118_ring_entry *e =
+		&ring->entry[pos & (SPD5118_RING_ENTRIES - 1)];
+	__u32 seq;
+
+	seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -1;
+
+	__builtin_memcpy(out, (const void *)e, sizeof(*out));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || out->pos != pos)
+		return -1;
+
+	return 0;
+}
+
+#endif /* !__KERNEL__ */
+
+#endif /* _SPD5118_H */